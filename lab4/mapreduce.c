@@ -9,12 +9,35 @@
  * means your code may assume it has been done.
  ******************************************************************************/
 
+/* O_DIRECT is a GNU extension; inputs may be larger than 2GB */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include "mapreduce.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #define UNCLAIMED -1		// the locker is not claimed by any map thread
 #define LOCKED    true		// the locker is locked
 #define UNLOCKED  false		// the locker is not locked
 
+#define CACHE_CHUNK  (1 << 20)	// nominal bytes of input per cached chunk
+#define CACHE_SCAN   4096	// first extra read when finishing a chunk's last record; doubles
+
+#define FNV_OFFSET   14695981039346656037ULL
+#define FNV_PRIME    1099511628211ULL
+
+#define SPEC_POLL_NS     10000000	// how often the straggler monitor wakes up (10ms)
+#define SPEC_MIN_RUNTIME 0.01		// never back up a split younger than this (seconds)
+
+#define READER_ALIGN 4096	// O_DIRECT buffer, offset and size alignment
+#define READER_BLOCK (1 << 20)	// default bytes per mr_reader read
+
+#define COMBINE_ENTRIES 4096	// keys a map thread combines before producing them
+
 bool verbose = true;
 
 struct args
@@ -25,9 +48,98 @@ struct args
 	int reduce_create_retval;
 	int infd;
 	int outfd;
+	bool backup;
+};
+
+/*
+ * One attempt at a split while speculation is on.  The pairs it produces are
+ * spooled to a private temporary file until the attempt finishes and finds
+ * out whether it won.
+ */
+struct attempt
+{
+	int     id;
+	FILE   *spool;
+	size_t  npairs;
+};
+
+/* the attempt the calling map thread is running, NULL outside speculation */
+static __thread struct attempt *current_attempt = NULL;
+
+/*
+ * A chunk of input being mapped so its output can be cached.  Map sees the
+ * chunk as a whole file with one map thread, so the pairs it produces are
+ * sent on to map thread id.
+ */
+struct chunk_map
+{
+	int      id;
+
+	/* cache file being recorded, NULL if it could not be created */
+	FILE    *record;
+	uint64_t checksum;
+
+	/* a pair was lost, so the recording must not be published */
+	bool     failed;
+};
+
+/* the chunk the calling map thread is mapping, NULL if none */
+static __thread struct chunk_map *current_chunk = NULL;
+
+/*
+ * Map-side combiner for a typed channel.  Each typed pair lands in an entry
+ * picked by hashing its key; a pair with the same key as the entry's is
+ * folded into it, and anything else pushes the old entry on to the lockers.
+ * Whatever is left is produced when the map function returns.
+ */
+struct combiner
+{
+	struct map_reduce *mr;
+
+	/* the map id the pairs are produced under */
+	int     id;
+
+	/* COMBINE_ENTRIES entries, allocated on first use */
+	bool   *used;
+	char   *keys;
+	char  **strkeys;
+	char   *values;
 };
 
+/* the combiner for the calling map thread, NULL outside a map function */
+static __thread struct combiner *current_combiner = NULL;
+
+/*
+ * Copies one field of a typed channel.  The size is only known at run time,
+ * so the common sizes are picked out by the switch and get a constant-size
+ * memcpy, which the compiler turns into a single load and store.
+ */
+static inline void copy_field(void *dst, const void *src, uint32_t size)
+{
+	switch (size)
+	{
+		case 4:  memcpy(dst, src, 4);    break;
+		case 8:  memcpy(dst, src, 8);    break;
+		default: memcpy(dst, src, size); break;
+	}
+}
+
+/*
+ * Can a pair of this shape go through the lockers?  Always true for untyped
+ * pairs; a typed channel only has room for pairs of its own shape.
+ */
+static inline bool channel_fits(struct map_reduce *mr, uint32_t keysz, uint32_t valuesz)
+{
+	if (mr->channel.valuesz == 0)
+		return true;
+
+	return valuesz == mr->channel.valuesz
+	       && (mr->channel.keysz == MR_STR_KEY || keysz == mr->channel.keysz);
+}
+
 int locker_count(struct map_reduce *mr);
+int open_input(struct map_reduce *mr, const char *path);
+static int call_map(struct map_reduce *mr, int infd, int id, int nmaps);
 
 struct map_reduce *mr_create(map_fn map, reduce_fn reduce, int threads, int buffer_size)
 {
@@ -120,6 +232,28 @@ struct map_reduce *mr_create(map_fn map, reduce_fn reduce, int threads, int buff
 	/* mapreduce status code */
 	mr->status_code = 0;
 
+	/* the map-output cache is off until mr_set_cache is called */
+	mr->cache_dir   = NULL;
+	mr->cache_tag   = NULL;
+
+	/* speculation is off until mr_set_speculation is called */
+	mr->speculate            = false;
+	mr->inpath               = NULL;
+	mr->splits               = NULL;
+	mr->splits_won           = 0;
+	mr->attempts_live        = 0;
+	mr->spec_monitor_started = false;
+	mr->spec_mutex           = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	mr->spec_cv              = (pthread_cond_t)  PTHREAD_COND_INITIALIZER;
+
+	/* inputs go through the page cache unless mr_set_direct_io says not to */
+	mr->direct_io            = false;
+
+	/* pairs are untyped until mr_set_channel is called */
+	memset(&(mr->channel), 0, sizeof(mr->channel));
+	mr->slab                 = NULL;
+	mr->slot_size            = 0;
+
 	if (verbose)
 	{
 		printf("MapReduce framework initialized...OK\n");
@@ -140,353 +274,2036 @@ void mr_destroy(struct map_reduce *mr)
 {
 	if (mr != NULL)
 	{
+		/* losing attempts may still be inside their map functions */
+		pthread_mutex_lock(&(mr->spec_mutex));
+		while (mr->attempts_live > 0)
+		{
+			pthread_cond_wait(&(mr->spec_cv), &(mr->spec_mutex));
+		}
+		pthread_mutex_unlock(&(mr->spec_mutex));
+
+		if (mr->spec_monitor_started)
+		{
+			pthread_join(mr->spec_monitor, NULL);
+		}
+
+		free(mr->inpath);
+		free(mr->splits);
+		free(mr->cache_dir);
+		free(mr->cache_tag);
+		free(mr->slab);
 		free(mr);
 	}
 }
 
-void *mr_map_helper(void *myArgs)
+int mr_set_cache(struct map_reduce *mr, const char *cache_dir, const char *map_tag)
 {
-	/* set up the arguments for the map function */
-	struct map_reduce *mr  = ((struct args *) myArgs)->mr;
-	int               infd = ((struct args *) myArgs)->infd;
-	int          thread_id = ((struct args *) myArgs)->thread_id;
-
-	bool done = false;
-/*
-	while (!done)
-	{*/
-		/* call the map function */
-		((struct args *) myArgs)->map_create_retval = (mr->map)(mr, infd, thread_id, mr->map_count);
+	if (mr == NULL || cache_dir == NULL || map_tag == NULL)
+		return -1;
 
-		if (((struct args *)myArgs)->map_create_retval == 0)
-		{
-			if (verbose)
-			{
-				printf("map thread %d signal to reduce thread\n", thread_id);
-			}
-		
-			pthread_cond_signal(&(mr->map_complete_cv));
-		pthread_cond_signal(&(mr->locker_contents_available_cv));
-		}
+	/* make sure the cache directory exists */
+	if (mkdir(cache_dir, S_IRWXU) < 0 && errno != EEXIST)
+	{
+		printf("I couldn't create the cache directory %s.\n", cache_dir);
+		return -1;
+	}
 
-		/* nothing left to map */
-		else
-		{
-			done = true;
-		}
-	/*}*/
+	free(mr->cache_dir);
+	free(mr->cache_tag);
 
-	/* update the number of maps done */
-	pthread_mutex_lock(&(mr->nmaps_done_mutex));
-	(mr->nmaps_done)++;
-	pthread_mutex_unlock(&(mr->nmaps_done_mutex));
+	mr->cache_dir = strdup(cache_dir);
+	mr->cache_tag = strdup(map_tag);
 
-	if (verbose)
+	if (mr->cache_dir == NULL || mr->cache_tag == NULL)
 	{
-		printf("map thread %d done. %d/%d complete.\n", 
-			thread_id, mr->nmaps_done, mr->map_count);
+		free(mr->cache_dir);
+		free(mr->cache_tag);
+
+		mr->cache_dir = NULL;
+		mr->cache_tag = NULL;
+
+		return -1;
 	}
 
-	/* the null pointer! */
-	return NULL;
+	return 0;
 }
 
-void *mr_reduce_helper(void *myArgs)
+int mr_set_speculation(struct map_reduce *mr, double done_fraction, double slowdown)
 {
-	/* set up the arguments for the reduce function */
-	struct map_reduce *mr  = ((struct args *) myArgs)->mr;
-	int              outfd = ((struct args *) myArgs)->outfd;
-
-	/* loop until all of the maps are done */
-	while (mr->nmaps_done < mr->map_count)
-	{
-		if (verbose)
-		{
-			printf("reduce wait for map thread\n");
-		}
+	if (mr == NULL)
+		return -1;
 
-		/* wait for a map thread to complete */
-		pthread_cond_wait(&(mr->map_complete_cv), &(mr->map_complete_mutex));
+	/* nothing would ever be backed up, or everything would be */
+	if (done_fraction <= 0 || done_fraction > 1 || slowdown <= 1)
+		return -1;
 
-		if (verbose)
-		{
-			printf("reduce thread now running\n");
-		}
+	mr->speculate          = true;
+	mr->spec_done_fraction = done_fraction;
+	mr->spec_slowdown      = slowdown;
 
-		/* call the reduce function */
-		((struct args *) myArgs)->reduce_create_retval = (mr->reduce)(mr, outfd, mr->map_count);
+	return 0;
+}
 
-		if (((struct args *) myArgs)->reduce_create_retval != 0)
-		{
-			/* something bad happened */
-			printf("reduce thread error\n");
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
 
-			/* update the status code */
-			mr->status_code = 1;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
 
-			/* mark everything as done and return */
-			mr->nmaps_done = mr->map_count;
-			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+	return hash;
+}
 
-			return NULL;
-		}
+/*
+ * SHA-256, used to name cache files.  Chunks come from log files that others
+ * can partly write to, so a name must not be easy to collide on purpose.
+ */
+struct sha256
+{
+	uint32_t      state[8];
+	uint64_t      length;
+	unsigned char block[64];
+	size_t        used;
+};
 
-	}
+static const uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
-	/* run the reduce thread for the last complete map operation */
-	//	((struct args *) myArgs)->reduce_create_retval = (mr->reduce)(mr, outfd, mr->map_count);
+static inline uint32_t rotr32(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
 
-	if (verbose)
+static void sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t initial[8] =
 	{
-		printf("reduce thread done. signal to main thread\n");
-	}
-
-	/* signal that the mapreduce operation is complete */		
-	pthread_cond_signal(&(mr->mapreduce_complete_cv));
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
 
-	/* the null pointer! */	
-	return NULL;
+	memcpy(ctx->state, initial, sizeof(initial));
+	ctx->length = 0;
+	ctx->used   = 0;
 }
 
-int mr_start(struct map_reduce *mr, const char *inpath, const char *outpath)
+/* mixes one 64-byte block into the state */
+static void sha256_block(struct sha256 *ctx, const unsigned char *p)
 {
-	if (verbose)
+	uint32_t w[64];
+
+	for (int i = 0; i < 16; i++)
 	{
-		printf("starting the reduce thread\n");
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16
+		     | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
 	}
 
-	/* check if buffer is too small to hold even a single kvpair */
-	if ((mr->buffer_size) < sizeof(struct kvpair))
+	for (int i = 16; i < 64; i++)
 	{
-		printf("Buffer too small. Square pegs don't go in round holes.\n");
-		
-		mr->status_code = 1;
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19)  ^ (w[i - 2] >> 10);
 
-		return 1;
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
 	}
-	
-	/* try to initialize the output file descriptor */
-	mr->outfd = open(outpath, O_WRONLY | O_CREAT, S_IRWXU);
 
-	/* check for errors */
-	if (mr->outfd < 0)
-	{
-		printf("I couldn't open the output file descriptor for the reduce thread.\n");
-		
-		mr->status_code = 1;
+	uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+	uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
 
-		/* signal that the mapreduce workflow is done */
-		pthread_cond_signal(&(mr->mapreduce_complete_cv));
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25))
+		            + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22))
+		            + ((a & b) ^ (a & c) ^ (b & c));
 
-		return 1;
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
 	}
 
-	/* get a pointer to the reduce thread */
-	pthread_t *reduceThread  = mr->reduceThread;
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
 
-	/* set up the reduce_args struct */
-	struct args *reduce_args = malloc(sizeof(struct args));
-	
-	reduce_args->mr			  =mr;
-	reduce_args->outfd 		  = mr->outfd;
-	reduce_args->reduce_create_retval = 0;
+static void sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
 
-	/* create the reduce thread */
-	pthread_create(reduceThread, NULL, mr_reduce_helper, (void *) reduce_args);
-	
-	if (reduce_args->reduce_create_retval != 0)
-	{
-		printf("I couldn't create the reduce thread.\n");
+	ctx->length += len;
 
-		mr->status_code = 1;
+	while (len > 0)
+	{
+		/* whole blocks go straight from the input */
+		if (ctx->used == 0 && len >= sizeof(ctx->block))
+		{
+			sha256_block(ctx, bytes);
+			bytes += sizeof(ctx->block);
+			len   -= sizeof(ctx->block);
+			continue;
+		}
 
-		/* signal that the mapreduce workflow is done */
-		pthread_cond_signal(&(mr->mapreduce_complete_cv));
+		size_t take = sizeof(ctx->block) - ctx->used;
 
-		return 1;
-	}
+		if (take > len)
+			take = len;
 
-	/* declare the input file descriptor */
-	int infd;
+		memcpy(ctx->block + ctx->used, bytes, take);
+		ctx->used += take;
+		bytes     += take;
+		len       -= take;
 
-	/* create the map threads */
-	for (int thread_id = 0; thread_id < mr->map_count; thread_id++)
-	{
-		if (verbose)
+		if (ctx->used == sizeof(ctx->block))
 		{
-			printf("starting the map thread with id=%d\n", thread_id);
+			sha256_block(ctx, ctx->block);
+			ctx->used = 0;
 		}
+	}
+}
 
-		/* get a pointer to the next map thread */
-		pthread_t *mapThread = &((mr->mapThreads)[thread_id]);
+static void sha256_final(struct sha256 *ctx, unsigned char digest[32])
+{
+	uint64_t      bits = ctx->length * 8;
+	unsigned char pad  = 0x80;
+	unsigned char zero = 0;
+	unsigned char tail[8];
 
-		/* try to initialize the input file descriptor */
-		infd = open(inpath, O_RDONLY); 
+	sha256_update(ctx, &pad, 1);
 
-		if (infd < 0)
-		{
-			printf("I couldn't open the input file descriptor for the map thread with id =%d.\n", thread_id);
+	while (ctx->used != 56)
+		sha256_update(ctx, &zero, 1);
 
-			mr->status_code = 1;
+	for (int i = 0; i < 8; i++)
+		tail[i] = bits >> (56 - 8 * i);
 
-			/* signal that the mapreduce workflow is done */
-			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+	sha256_update(ctx, tail, sizeof(tail));
 
-			return 1;
-		}
-		
-		/* set up the map_args struct */
-		struct args *map_args   = malloc(sizeof(struct args));
+	for (int i = 0; i < 32; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
 
-		map_args->mr        = mr;
-		map_args->infd      = infd;
-		map_args->thread_id = thread_id;
-		map_args->map_create_retval = 0;
+/*
+ * Reads count bytes at offset.  O_DIRECT descriptors need aligned reads, so
+ * they go through a reader; anything else uses plain pread, which leaves the
+ * data in the page cache for Map to read again.  Returns 0 on success, -1 on
+ * failure.
+ */
+static int read_range(struct map_reduce *mr, int infd, void *buf, size_t count, int64_t offset)
+{
+	int flags = fcntl(infd, F_GETFL);
 
-		/* create the next map thread */
-		pthread_create(mapThread, NULL, mr_map_helper, (void *) map_args);
-		
-		/* check for errors */
-		if (map_args->map_create_retval != 0)
+	if (flags < 0)
+		return -1;
+
+	if (!(flags & O_DIRECT))
+	{
+		for (size_t done = 0; done < count; )
 		{
-			printf("I couldn't create the map thread with id=%d.\n", thread_id);
+			ssize_t got = pread(infd, (char *) buf + done, count - done, offset + done);
 
-			mr->status_code = 1;
+			if (got < 0 && errno == EINTR)
+				continue;
 
-			/* signal that the mapreduce workflow is done */
-			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+			if (got <= 0)
+				return -1;
 
-			return 1;
+			done += got;
 		}
+
+		return 0;
 	}
 
-	// done
-	return 0;
-}
+	struct mr_reader *reader = mr_reader_open(mr, infd, offset, count);
 
-int mr_finish(struct map_reduce *mr) 
-{
-	/* wait until the entire mapreduce workflow is complete */
-	pthread_cond_wait(&(mr->mapreduce_complete_cv), &(mr->mapreduce_complete_mutex));
+	if (reader == NULL)
+		return -1;
 
-	if (verbose)
-	{
-		printf("mapreduce operation is complete\n");
-	}
+	ssize_t got = mr_reader_read(reader, buf, count);
 
-	/* try to close the output file descriptor */
-	if (close(mr->outfd) < 0)
-	{
-		printf("I couldn't close the output file descriptor.\n");
-		mr->status_code = 1;
-	}
+	mr_reader_close(reader);
 
-	return mr->status_code;
+	return (got == (ssize_t) count) ? 0 : -1;
 }
 
-int mr_produce(struct map_reduce *mr, int id, const struct kvpair *kv)
+/*
+ * Loads cached chunk k of the input.  Chunk k runs from just past the first
+ * newline at or after offset k * CACHE_CHUNK (or from the start of the file)
+ * to just past the first newline at or after (k + 1) * CACHE_CHUNK (or to the
+ * end of the file).  Those boundaries only depend on the bytes around them,
+ * so appending to the file only moves the end of the last chunk.
+ *
+ * Returns a buffer holding the input from k * CACHE_CHUNK onwards, with the
+ * chunk itself at [*start, *end), or NULL on failure.
+ */
+static char *chunk_load(struct map_reduce *mr, int infd, int64_t size, int64_t k, size_t *start, size_t *end)
 {
-	/* wait for an empty locker to become available */
-	if (mr->lockers_in_use == locker_count(mr))
+	int64_t base = k * CACHE_CHUNK;
+	size_t  scan = CACHE_SCAN;
+	size_t  cap  = CACHE_CHUNK + scan;
+	size_t  n    = 0;
+	char   *buf  = NULL;
+	char   *nl;
+
+	/*
+	 * Read the nominal chunk, then keep going until the record at its end is
+	 * complete.  The window past the chunk doubles each time, so a very long
+	 * record costs a logarithmic number of reads rather than one per 4KB.
+	 */
+	for (;;)
 	{
-		printf("%d waiting for empty locker\n", id);
-		pthread_cond_wait(&(mr->empty_locker_available_cv), &(mr->empty_locker_available_mutex));
-	}
+		char *bigger = realloc(buf, cap);
 
-	printf("%d locker available for storage\n", id);
+		if (bigger == NULL)
+		{
+			free(buf);
+			return NULL;
+		}
 
-	/* a locker is available! */
-	pthread_mutex_lock(&(mr->locks_mutex));
+		buf = bigger;
 
-	/* search for the empty locker */
-	for (int i = 0; i < locker_count(mr); i++)
-	{
-		if (mr->locks[i] != LOCKED)
+		size_t want = (size - base - n < cap - n) ? size - base - n : cap - n;
+
+		if (want > 0 && read_range(mr, infd, buf + n, want, base + n) < 0)
 		{
-			printf("%d found empty locker %d, now producing\n", id, i);
-			/* we found an unlocked locker! */
-			mr->claims[id] = i;
-			mr->locks [i]  = LOCKED;
-			(mr->lockers_in_use)++;
+			free(buf);
+			return NULL;
+		}
 
-			pthread_mutex_unlock(&(mr->locks_mutex));
+		n += want;
+
+		if (n > CACHE_CHUNK && (nl = memchr(buf + CACHE_CHUNK, '\n', n - CACHE_CHUNK)) != NULL)
+		{
+			*end = nl - buf + 1;
+			break;
+		}
+
+		if (base + n >= size)
+		{
+			*end = n;
 			break;
 		}
+
+		scan *= 2;
+		cap   = CACHE_CHUNK + scan;
 	}
 
-	/* what locker do I have? */
-	int my_locker 	   = mr->claims[id];
+	/* the record straddling the nominal start belongs to the chunk before */
+	if (k == 0)
+	{
+		*start = 0;
+	}
+	else
+	{
+		nl     = memchr(buf, '\n', *end);
+		*start = (nl != NULL) ? nl - buf + 1 : *end;
+	}
 
-	/* serialize the kvpair...using another kvpair! */
-	struct kvpair *locker_contents = malloc(sizeof(struct kvpair));
+	return buf;
+}
 
-	/* allocate the key and the value using the keysz and valuesz in kv */
-	locker_contents->key   = malloc(kv->keysz);
-	locker_contents->value = malloc(kv->valuesz);
- 
- 	/* copy the key and the value to the new kvpair */
-	locker_contents->key   = kv->key;
-	locker_contents->value = kv->value;
+/*
+ * Header at the front of every cache file.  It records the chunk the file was
+ * made from with a hash independent of the SHA-256 in the file name, so a
+ * file is only replayed for a chunk that matches both.
+ */
+struct cache_header
+{
+	uint64_t length;
+	uint64_t fnv;
+};
 
-	/* update keysz and valuesz in the new kvpair */
-	locker_contents->keysz   = kv->keysz;
-	locker_contents->valuesz = kv->valuesz;
+/*
+ * Feeds every key-value pair in a cache file back through mr_produce.  The
+ * whole file is checked first: its header must match the chunk at [chunk,
+ * chunk + len), its contents must match the trailing checksum, and every pair
+ * must fit the channel.  A file that fails any check is removed and treated
+ * as missing, so nothing from it is ever produced.  Returns 1 if the file was replayed, 0 if there is no
+ * usable file, or -1 if a pair could not be produced.
+ */
+int cache_replay(struct map_reduce *mr, int id, const char *path, const char *chunk, size_t len)
+{
+	FILE *fp = fopen(path, "rb");
 
-	/* store the new locker contents in my locker */
-	mr->lockers[my_locker] = *locker_contents;
+	if (fp == NULL)
+		return 0;
 
-	/* signal that some data is available to consume */
-	printf("%d  signal that contents ready for consumption\n", id);
-	pthread_cond_signal(&(mr->locker_contents_available_cv));
+	char *data = NULL;
+	long  size = -1;
+
+	if (fseek(fp, 0, SEEK_END) == 0
+	    && (size = ftell(fp)) >= (long) (sizeof(struct cache_header) + sizeof(uint64_t))
+	    && fseek(fp, 0, SEEK_SET) == 0 && (data = malloc(size)) != NULL
+	    && fread(data, 1, size, fp) != (size_t) size)
+	{
+		free(data);
+		data = NULL;
+	}
+
+	fclose(fp);
+
+	/* the records must tile the file exactly, and match the trailing checksum */
+	size_t   body  = (data != NULL) ? size - sizeof(uint64_t) : 0;
+	size_t   pos   = sizeof(struct cache_header);
+	uint64_t check = 0;
+	uint32_t sizes[2];
+
+	struct cache_header header = { 0, 0 };
+
+	while (data != NULL && body - pos >= sizeof(sizes))
+	{
+		memcpy(sizes, data + pos, sizeof(sizes));
+
+		if ((uint64_t) sizes[0] + sizes[1] > body - pos - sizeof(sizes))
+			break;
+
+		/* pairs that the channel would refuse make the file useless to us */
+		if (!channel_fits(mr, sizes[0], sizes[1]))
+			break;
+
+		pos += sizeof(sizes) + sizes[0] + sizes[1];
+	}
+
+	if (data != NULL)
+	{
+		memcpy(&header, data, sizeof(header));
+		memcpy(&check,  data + body, sizeof(check));
+	}
+
+	if (data == NULL || pos != body || check != fnv1a(FNV_OFFSET, data, body)
+	    || header.length != len || header.fnv != fnv1a(FNV_OFFSET, chunk, len))
+	{
+		printf("cache file %s is damaged or does not match, removing it\n", path);
+
+		free(data);
+		unlink(path);
+
+		return 0;
+	}
+
+	struct kvpair kv;
+
+	for (pos = sizeof(header); pos < body; pos += sizeof(sizes) + kv.keysz + kv.valuesz)
+	{
+		memcpy(sizes, data + pos, sizeof(sizes));
+
+		kv.keysz   = sizes[0];
+		kv.valuesz = sizes[1];
+		kv.key     = data + pos + sizeof(sizes);
+		kv.value   = data + pos + sizeof(sizes) + kv.keysz;
+
+		if (mr_produce(mr, id, &kv) != 1)
+		{
+			free(data);
+			return -1;
+		}
+	}
+
+	free(data);
 
-	// done
 	return 1;
 }
 
-int mr_consume(struct map_reduce *mr, int id, struct kvpair *kv)
+/*
+ * Appends one key-value pair to a cache file, folding the bytes written into
+ * *checksum unless it is NULL.  Returns 0 on success, -1 on failure.
+ */
+int cache_record(FILE *fp, const struct kvpair *kv, uint64_t *checksum)
 {
-	/* wait until the locker has data */
+	uint32_t sizes[2] = { kv->keysz, kv->valuesz };
 
-	if(mr->nmaps_done == mr->map_count)
+	if (fwrite(sizes,     sizeof(uint32_t), 2, fp) != 2
+	    || fwrite(kv->key,   1, kv->keysz,   fp) != kv->keysz
+	    || fwrite(kv->value, 1, kv->valuesz, fp) != kv->valuesz)
 	{
-		printf("Leaving mr_consume as map threads are done\n");
-		return 0;	
+		return -1;
 	}
 
-	if(mr->claims[id] == UNCLAIMED)
+	if (checksum != NULL)
 	{
-		printf("Leaving mr_consume as nothing to be retrieved.\n");
+		*checksum = fnv1a(*checksum, sizes,     sizeof(sizes));
+		*checksum = fnv1a(*checksum, kv->key,   kv->keysz);
+		*checksum = fnv1a(*checksum, kv->value, kv->valuesz);
+	}
+
+	return 0;
+}
+
+/*
+ * Runs the map function over one chunk on behalf of map thread id, recording
+ * its output to the cache file at path.  Map is handed a descriptor holding
+ * only the chunk, as map thread 0 of 1.  Returns 0 on success, -1 on failure.
+ */
+static int map_chunk(struct map_reduce *mr, int id, const char *data, size_t len, const char *path)
+{
+	int chunkfd = memfd_create("mr-chunk", 0);
+
+	if (chunkfd < 0)
+		return -1;
+
+	for (size_t done = 0; done < len; )
+	{
+		ssize_t wrote = write(chunkfd, data + done, len - done);
+
+		if (wrote < 0 && errno == EINTR)
+			continue;
+
+		if (wrote <= 0)
+		{
+			close(chunkfd);
+			return -1;
+		}
+
+		done += wrote;
+	}
+
+	lseek(chunkfd, 0, SEEK_SET);
+
+	/* record into a private file and publish it only if the whole chunk made it */
+	char temp[PATH_MAX + 8];
+	snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+
+	int               tempfd = mkstemp(temp);
+	struct chunk_map  chunk  = { .id = id, .record = NULL, .checksum = FNV_OFFSET, .failed = false };
+
+	if (tempfd >= 0 && (chunk.record = fdopen(tempfd, "wb")) == NULL)
+	{
+		close(tempfd);
+		unlink(temp);
+		tempfd = -1;
+	}
+
+	/* the header ties the file to these exact bytes */
+	struct cache_header header = { len, fnv1a(FNV_OFFSET, data, len) };
+
+	if (chunk.record != NULL)
+	{
+		if (fwrite(&header, sizeof(header), 1, chunk.record) != 1)
+			chunk.failed = true;
+
+		chunk.checksum = fnv1a(chunk.checksum, &header, sizeof(header));
+	}
+
+	current_chunk = &chunk;
+	int retval = call_map(mr, chunkfd, 0, 1);
+	current_chunk = NULL;
+
+	close(chunkfd);
+
+	if (chunk.record != NULL)
+	{
+		/* the checksum trailer marks the recording as complete */
+		if (fwrite(&(chunk.checksum), sizeof(uint64_t), 1, chunk.record) != 1)
+			chunk.failed = true;
+
+		if (fclose(chunk.record) != 0 || chunk.failed || retval != 0 || rename(temp, path) != 0)
+			unlink(temp);
+	}
+
+	return (retval == 0) ? 0 : -1;
+}
+
+/*
+ * Produces the output for chunk k, from the cache if we have seen its bytes
+ * before and by mapping it otherwise.  Returns 0 on success, -1 on failure.
+ */
+static int cache_chunk(struct map_reduce *mr, int infd, int id, int64_t size, int64_t k)
+{
+	size_t start, end;
+	char  *data = chunk_load(mr, infd, size, k, &start, &end);
+
+	if (data == NULL)
+		return -1;
+
+	/* a record longer than a chunk can leave nothing between two boundaries */
+	if (start >= end)
+	{
+		free(data);
 		return 0;
 	}
 
-	/* wait until at least one locker has data */
-	printf("%d waiting for locker data\n", id);
+	struct sha256 ctx;
+	unsigned char digest[32];
+	char          name[2 * sizeof(digest) + 1];
 
-	if (mr->lockers_in_use == 0 && mr->nmaps_done < mr->map_count)
+	/* pairs recorded for one channel shape must not be replayed into another */
+	uint32_t shape[3] = { mr->channel.keysz, mr->channel.valuesz, mr->channel.combine != NULL };
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, mr->cache_tag, strlen(mr->cache_tag) + 1);
+	sha256_update(&ctx, shape, sizeof(shape));
+	sha256_update(&ctx, data + start, end - start);
+	sha256_final(&ctx, digest);
+
+	for (int i = 0; i < (int) sizeof(digest); i++)
 	{
-		pthread_cond_wait(&(mr->locker_contents_available_cv), &(mr->locker_contents_available_mutex));
+		sprintf(name + 2 * i, "%02x", digest[i]);
+	}
 
-		pthread_cond_wait(&(mr->map_complete_cv), &(mr->map_complete_mutex));
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s.kv", mr->cache_dir, name) >= sizeof(path))
+	{
+		free(data);
+		return -1;
 	}
-	
-	/* what locker do I have? */
-	int my_locker = mr->claims[id];
 
-	printf("%d consuming contents of locker %d\n", id, my_locker);
+	/* seen this chunk before? */
+	int retval = cache_replay(mr, id, path, data + start, end - start);
 
-	/* unserialize (or not really) the data */
-	kv = &(mr->lockers[my_locker]);
+	if (retval > 0)
+	{
+		if (verbose)
+		{
+			printf("map thread %d replayed %s\n", id, path);
+		}
 
-	/* mark the locker as unlocked and unclaimed*/
-	pthread_mutex_lock(&(mr->locks_mutex));
-	mr->locks[my_locker] = !(LOCKED);
-	(mr->lockers_in_use)--;
-	mr->claims[id] = UNCLAIMED;
-	pthread_mutex_unlock(&(mr->locks_mutex));
+		free(data);
+		return 0;
+	}
 
-	/* signal that a locker is now empty */
-	printf("%d locker %d is now consumed\n", id, my_locker);
-	pthread_cond_broadcast(&(mr->empty_locker_available_cv));
+	if (retval < 0)
+	{
+		printf("map thread %d could not replay %s\n", id, path);
+
+		free(data);
+		return -1;
+	}
+
+	retval = map_chunk(mr, id, data + start, end - start, path);
+
+	free(data);
+
+	return retval;
+}
+
+/*
+ * Runs the map function for thread id, going through the map-output cache if
+ * it is enabled.  Returns the map function's return value.
+ */
+int mr_run_map(struct map_reduce *mr, int infd, int id)
+{
+	struct stat st;
+
+	/* no cache, or we cannot size the input: just map the split */
+	if (mr->cache_dir == NULL || fstat(infd, &st) < 0)
+		return call_map(mr, infd, id, mr->map_count);
+
+	/* this thread takes its share of the fixed-size chunks */
+	int64_t nchunks = (st.st_size + CACHE_CHUNK - 1) / CACHE_CHUNK;
+	int64_t first   = nchunks * id / mr->map_count;
+	int64_t last    = nchunks * (id + 1) / mr->map_count;
+
+	for (int64_t k = first; k < last; k++)
+	{
+		if (cache_chunk(mr, infd, id, st.st_size, k) < 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static double seconds_since(const struct timespec *then)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/*
+ * Spools a pair produced by a speculative attempt.  Returns 1 on success, or
+ * -1 if the split has already been won by another attempt (so the map
+ * function can give up) or the spool cannot be written.
+ */
+int attempt_spool(struct map_reduce *mr, struct attempt *attempt, const struct kvpair *kv)
+{
+	if (__atomic_load_n(&(mr->splits[attempt->id].won), __ATOMIC_ACQUIRE))
+		return -1;
+
+	if (attempt->spool == NULL || cache_record(attempt->spool, kv, NULL) < 0)
+		return -1;
+
+	(attempt->npairs)++;
 
 	return 1;
 }
+
+/*
+ * Streams the pairs in a winning attempt's spool into mr_produce, one at a
+ * time, so they never all sit in memory.  Returns 0 on success, -1 on failure.
+ */
+int spool_replay(struct map_reduce *mr, int id, FILE *spool)
+{
+	struct kvpair kv     = { NULL, NULL, 0, 0 };
+	uint32_t      sizes[2];
+	size_t        keycap = 0, valuecap = 0;
+	int           retval = 0;
+
+	if (fflush(spool) != 0 || fseek(spool, 0, SEEK_SET) != 0)
+		return -1;
+
+	while (retval == 0 && fread(sizes, sizeof(uint32_t), 2, spool) == 2)
+	{
+		/* grow the buffers when a bigger pair comes along */
+		if (sizes[0] > keycap)
+		{
+			free(kv.key);
+			keycap = sizes[0];
+			kv.key = malloc(keycap);
+		}
+
+		if (sizes[1] > valuecap)
+		{
+			free(kv.value);
+			valuecap = sizes[1];
+			kv.value = malloc(valuecap);
+		}
+
+		kv.keysz   = sizes[0];
+		kv.valuesz = sizes[1];
+
+		if ((kv.keysz > 0 && kv.key == NULL) || (kv.valuesz > 0 && kv.value == NULL)
+		    || fread(kv.key,   1, kv.keysz,   spool) != kv.keysz
+		    || fread(kv.value, 1, kv.valuesz, spool) != kv.valuesz
+		    || mr_produce(mr, id, &kv) != 1)
+		{
+			retval = -1;
+		}
+	}
+
+	if (ferror(spool))
+		retval = -1;
+
+	free(kv.key);
+	free(kv.value);
+
+	return retval;
+}
+
+/*
+ * Makes every further read from fd see end of file, by putting a descriptor
+ * open on /dev/null in its place.  Used to stop attempts that lost their split.
+ */
+static void cut_off_input(int fd)
+{
+	int devnull = open("/dev/null", O_RDONLY);
+
+	if (devnull < 0)
+		return;
+
+	dup2(devnull, fd);
+	close(devnull);
+}
+
+/*
+ * Runs one attempt at split id with its pairs buffered.  If the attempt wins
+ * the split, its pairs are passed on to the reduce thread and true is
+ * returned; otherwise they are dropped and false is returned.  Either way the
+ * map function's return value is stored in retval.
+ */
+bool mr_run_attempt(struct map_reduce *mr, int infd, int id, int *retval)
+{
+	struct attempt    attempt = { .id = id, .spool = tmpfile(), .npairs = 0 };
+	struct map_split *split   = &(mr->splits[id]);
+
+	/* let the winner find our input; if the split is already won, we have lost */
+	pthread_mutex_lock(&(mr->spec_mutex));
+
+	int slot = (split->fds[0] < 0) ? 0 : 1;
+
+	if (split->won)
+		cut_off_input(infd);
+	else
+		split->fds[slot] = infd;
+
+	pthread_mutex_unlock(&(mr->spec_mutex));
+
+	current_attempt = &attempt;
+	*retval = mr_run_map(mr, infd, id);
+	current_attempt = NULL;
+
+	/*
+	 * The first successful attempt wins the split.  A failed attempt steps
+	 * aside while another attempt is still running, and only reports the
+	 * failure if it was the last one left.
+	 */
+	pthread_mutex_lock(&(mr->spec_mutex));
+
+	/* our descriptor may be closed once we return, so it must not be cut off */
+	if (split->fds[slot] == infd)
+		split->fds[slot] = -1;
+
+	(split->running)--;
+
+	bool won = !split->won && (*retval == 0 || split->running == 0);
+
+	if (won)
+	{
+		split->elapsed = seconds_since(&(split->started));
+		__atomic_store_n(&(split->won), true, __ATOMIC_RELEASE);
+		(mr->splits_won)++;
+
+		/* stop the other attempt reading input it no longer needs */
+		for (int i = 0; i < 2; i++)
+		{
+			if (split->fds[i] >= 0)
+				cut_off_input(split->fds[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&(mr->spec_mutex));
+
+	if (won)
+	{
+		/* the split is ours, so a pair that does not make it fails the split */
+		if (attempt.npairs > 0 && spool_replay(mr, id, attempt.spool) < 0)
+		{
+			printf("map thread %d could not hand over its output\n", id);
+			*retval = 1;
+		}
+	}
+	else if (verbose)
+	{
+		printf("map thread %d attempt lost, dropping %zu pairs\n", id, attempt.npairs);
+	}
+
+	/* tmpfile() spools delete themselves on close */
+	if (attempt.spool != NULL)
+		fclose(attempt.spool);
+
+	return won;
+}
+
+/*
+ * Tells the reduce thread that map thread id has finished with status retval.
+ */
+void map_complete(struct map_reduce *mr, int thread_id, int retval)
+{
+	/* a split that failed means the output is incomplete */
+	if (retval != 0)
+	{
+		printf("map thread %d failed\n", thread_id);
+		mr->status_code = 1;
+	}
+
+	if (retval == 0)
+	{
+		if (verbose)
+		{
+			printf("map thread %d signal to reduce thread\n", thread_id);
+		}
+
+		pthread_cond_signal(&(mr->map_complete_cv));
+		pthread_cond_signal(&(mr->locker_contents_available_cv));
+	}
+
+	/* update the number of maps done */
+	pthread_mutex_lock(&(mr->nmaps_done_mutex));
+	(mr->nmaps_done)++;
+	pthread_mutex_unlock(&(mr->nmaps_done_mutex));
+
+	if (verbose)
+	{
+		printf("map thread %d done. %d/%d complete.\n",
+			thread_id, mr->nmaps_done, mr->map_count);
+	}
+}
+
+void *mr_map_helper(void *myArgs)
+{
+	/* set up the arguments for the map function */
+	struct map_reduce *mr  = ((struct args *) myArgs)->mr;
+	int               infd = ((struct args *) myArgs)->infd;
+	int          thread_id = ((struct args *) myArgs)->thread_id;
+	bool            backup = ((struct args *) myArgs)->backup;
+
+	/* call the map function */
+	if (!mr->speculate)
+	{
+		((struct args *) myArgs)->map_create_retval = mr_run_map(mr, infd, thread_id);
+
+		map_complete(mr, thread_id, ((struct args *) myArgs)->map_create_retval);
+
+		/* the null pointer! */
+		return NULL;
+	}
+
+	/* only the attempt that wins its split reports completion */
+	if (mr_run_attempt(mr, infd, thread_id, &(((struct args *) myArgs)->map_create_retval)))
+	{
+		map_complete(mr, thread_id, ((struct args *) myArgs)->map_create_retval);
+	}
+
+	/* backups are started by the framework, so they clean up after themselves */
+	if (backup)
+	{
+		close(infd);
+		free(myArgs);
+	}
+
+	/* let the monitor and mr_destroy know this attempt is finished */
+	pthread_mutex_lock(&(mr->spec_mutex));
+	(mr->attempts_live)--;
+	pthread_cond_broadcast(&(mr->spec_cv));
+	pthread_mutex_unlock(&(mr->spec_mutex));
+
+	/* the null pointer! */
+	return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Starts a backup attempt at split id on a new thread.  Called with spec_mutex
+ * held.
+ */
+void launch_backup(struct map_reduce *mr, int id)
+{
+	/* whatever happens, only try once per split */
+	mr->splits[id].backed_up = true;
+
+	int infd = open_input(mr, mr->inpath);
+
+	if (infd < 0)
+		return;
+
+	struct args *backup_args = malloc(sizeof(struct args));
+
+	if (backup_args == NULL)
+	{
+		close(infd);
+		return;
+	}
+
+	backup_args->mr                = mr;
+	backup_args->infd              = infd;
+	backup_args->thread_id         = id;
+	backup_args->map_create_retval = 0;
+	backup_args->backup            = true;
+
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, mr_map_helper, (void *) backup_args) != 0)
+	{
+		close(infd);
+		free(backup_args);
+		return;
+	}
+
+	pthread_detach(thread);
+	(mr->attempts_live)++;
+	(mr->splits[id].running)++;
+
+	if (verbose)
+	{
+		printf("split %d is straggling, started a backup attempt\n", id);
+	}
+}
+
+/*
+ * Watches the running splits and backs up any that are taking much longer
+ * than the median finished split.  Exits once every split has been won.
+ */
+void *mr_spec_monitor(void *arg)
+{
+	struct map_reduce *mr = arg;
+	double *times = malloc(mr->map_count * sizeof(double));
+
+	if (times == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&(mr->spec_mutex));
+
+	while (mr->splits_won < mr->map_count)
+	{
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+
+		wake.tv_nsec += SPEC_POLL_NS;
+		wake.tv_sec  += wake.tv_nsec / 1000000000;
+		wake.tv_nsec %= 1000000000;
+
+		pthread_cond_timedwait(&(mr->spec_cv), &(mr->spec_mutex), &wake);
+
+		/* wait until enough splits are done to know what normal looks like */
+		if (mr->splits_won == 0 || mr->splits_won < mr->spec_done_fraction * mr->map_count)
+			continue;
+
+		int ntimes = 0;
+
+		for (int i = 0; i < mr->map_count; i++)
+		{
+			if (mr->splits[i].won)
+				times[ntimes++] = mr->splits[i].elapsed;
+		}
+
+		qsort(times, ntimes, sizeof(double), compare_doubles);
+
+		double median = (ntimes % 2) ? times[ntimes / 2]
+		                             : (times[ntimes / 2 - 1] + times[ntimes / 2]) / 2;
+
+		for (int i = 0; i < mr->map_count; i++)
+		{
+			struct map_split *split = &(mr->splits[i]);
+
+			if (split->won || split->backed_up)
+				continue;
+
+			double running = seconds_since(&(split->started));
+
+			if (running > SPEC_MIN_RUNTIME && running > mr->spec_slowdown * median)
+				launch_backup(mr, i);
+		}
+	}
+
+	pthread_mutex_unlock(&(mr->spec_mutex));
+
+	free(times);
+
+	return NULL;
+}
+
+void *mr_reduce_helper(void *myArgs)
+{
+	/* set up the arguments for the reduce function */
+	struct map_reduce *mr  = ((struct args *) myArgs)->mr;
+	int              outfd = ((struct args *) myArgs)->outfd;
+
+	/* loop until all of the maps are done */
+	while (mr->nmaps_done < mr->map_count)
+	{
+		if (verbose)
+		{
+			printf("reduce wait for map thread\n");
+		}
+
+		/* wait for a map thread to complete */
+		pthread_cond_wait(&(mr->map_complete_cv), &(mr->map_complete_mutex));
+
+		if (verbose)
+		{
+			printf("reduce thread now running\n");
+		}
+
+		/* call the reduce function */
+		((struct args *) myArgs)->reduce_create_retval = (mr->reduce)(mr, outfd, mr->map_count);
+
+		if (((struct args *) myArgs)->reduce_create_retval != 0)
+		{
+			/* something bad happened */
+			printf("reduce thread error\n");
+
+			/* update the status code */
+			mr->status_code = 1;
+
+			/* mark everything as done and return */
+			mr->nmaps_done = mr->map_count;
+			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+			return NULL;
+		}
+
+	}
+
+	/* run the reduce thread for the last complete map operation */
+	//	((struct args *) myArgs)->reduce_create_retval = (mr->reduce)(mr, outfd, mr->map_count);
+
+	if (verbose)
+	{
+		printf("reduce thread done. signal to main thread\n");
+	}
+
+	/* signal that the mapreduce operation is complete */		
+	pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+	/* the null pointer! */	
+	return NULL;
+}
+
+int mr_start(struct map_reduce *mr, const char *inpath, const char *outpath)
+{
+	if (verbose)
+	{
+		printf("starting the reduce thread\n");
+	}
+
+	/* check if buffer is too small to hold even a single kvpair */
+	if ((mr->buffer_size) < sizeof(struct kvpair))
+	{
+		printf("Buffer too small. Square pegs don't go in round holes.\n");
+		
+		mr->status_code = 1;
+
+		return 1;
+	}
+	
+	/* try to initialize the output file descriptor */
+	mr->outfd = open(outpath, O_WRONLY | O_CREAT, S_IRWXU);
+
+	/* check for errors */
+	if (mr->outfd < 0)
+	{
+		printf("I couldn't open the output file descriptor for the reduce thread.\n");
+		
+		mr->status_code = 1;
+
+		/* signal that the mapreduce workflow is done */
+		pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+		return 1;
+	}
+
+	/* get a pointer to the reduce thread */
+	pthread_t *reduceThread  = mr->reduceThread;
+
+	/* set up the reduce_args struct */
+	struct args *reduce_args = malloc(sizeof(struct args));
+	
+	reduce_args->mr			  =mr;
+	reduce_args->outfd 		  = mr->outfd;
+	reduce_args->reduce_create_retval = 0;
+
+	/* create the reduce thread */
+	pthread_create(reduceThread, NULL, mr_reduce_helper, (void *) reduce_args);
+	
+	if (reduce_args->reduce_create_retval != 0)
+	{
+		printf("I couldn't create the reduce thread.\n");
+
+		mr->status_code = 1;
+
+		/* signal that the mapreduce workflow is done */
+		pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+		return 1;
+	}
+
+	/* backups of straggling splits need to reopen the input */
+	if (mr->speculate)
+	{
+		mr->inpath = strdup(inpath);
+		mr->splits = calloc(mr->map_count, sizeof(struct map_split));
+
+		if (mr->inpath == NULL || mr->splits == NULL)
+		{
+			printf("I couldn't set up speculative execution.\n");
+
+			mr->status_code = 1;
+
+			/* signal that the mapreduce workflow is done */
+			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+			return 1;
+		}
+
+		for (int i = 0; i < mr->map_count; i++)
+		{
+			mr->splits[i].fds[0] = -1;
+			mr->splits[i].fds[1] = -1;
+		}
+	}
+
+	/* declare the input file descriptor */
+	int infd;
+
+	/* create the map threads */
+	for (int thread_id = 0; thread_id < mr->map_count; thread_id++)
+	{
+		if (verbose)
+		{
+			printf("starting the map thread with id=%d\n", thread_id);
+		}
+
+		/* get a pointer to the next map thread */
+		pthread_t *mapThread = &((mr->mapThreads)[thread_id]);
+
+		/* try to initialize the input file descriptor */
+		infd = open_input(mr, inpath);
+
+		if (infd < 0)
+		{
+			printf("I couldn't open the input file descriptor for the map thread with id =%d.\n", thread_id);
+
+			mr->status_code = 1;
+
+			/* signal that the mapreduce workflow is done */
+			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+			return 1;
+		}
+		
+		/* set up the map_args struct */
+		struct args *map_args   = malloc(sizeof(struct args));
+
+		map_args->mr        = mr;
+		map_args->infd      = infd;
+		map_args->thread_id = thread_id;
+		map_args->map_create_retval = 0;
+		map_args->backup    = false;
+
+		/* the clock for a split starts with its first attempt */
+		if (mr->speculate)
+		{
+			pthread_mutex_lock(&(mr->spec_mutex));
+			clock_gettime(CLOCK_MONOTONIC, &(mr->splits[thread_id].started));
+			(mr->attempts_live)++;
+			(mr->splits[thread_id].running)++;
+			pthread_mutex_unlock(&(mr->spec_mutex));
+		}
+
+		/* create the next map thread */
+		pthread_create(mapThread, NULL, mr_map_helper, (void *) map_args);
+		
+		/* check for errors */
+		if (map_args->map_create_retval != 0)
+		{
+			printf("I couldn't create the map thread with id=%d.\n", thread_id);
+
+			mr->status_code = 1;
+
+			/* signal that the mapreduce workflow is done */
+			pthread_cond_signal(&(mr->mapreduce_complete_cv));
+
+			return 1;
+		}
+	}
+
+	/* start watching for stragglers */
+	if (mr->speculate)
+	{
+		if (pthread_create(&(mr->spec_monitor), NULL, mr_spec_monitor, (void *) mr) == 0)
+		{
+			mr->spec_monitor_started = true;
+		}
+	}
+
+	// done
+	return 0;
+}
+
+int mr_finish(struct map_reduce *mr) 
+{
+	/* wait until the entire mapreduce workflow is complete */
+	pthread_cond_wait(&(mr->mapreduce_complete_cv), &(mr->mapreduce_complete_mutex));
+
+	if (verbose)
+	{
+		printf("mapreduce operation is complete\n");
+	}
+
+	/* try to close the output file descriptor */
+	if (close(mr->outfd) < 0)
+	{
+		printf("I couldn't close the output file descriptor.\n");
+		mr->status_code = 1;
+	}
+
+	return mr->status_code;
+}
+
+int mr_produce(struct map_reduce *mr, int id, const struct kvpair *kv)
+{
+	/* a chunk is being mapped for the cache: record the pair, then send it on */
+	if (current_chunk != NULL)
+	{
+		struct chunk_map *chunk = current_chunk;
+
+		if (chunk->record != NULL && cache_record(chunk->record, kv, &(chunk->checksum)) < 0)
+			chunk->failed = true;
+
+		current_chunk = NULL;
+		int retval = mr_produce(mr, chunk->id, kv);
+		current_chunk = chunk;
+
+		if (retval != 1)
+			chunk->failed = true;
+
+		return retval;
+	}
+
+	/* speculative attempts spool their pairs until they know they won */
+	if (current_attempt != NULL)
+		return attempt_spool(mr, current_attempt, kv);
+
+	/* a typed channel's lockers only have room for pairs of its shape */
+	char *strkey = NULL;
+
+	if (!channel_fits(mr, kv->keysz, kv->valuesz))
+		return -1;
+
+	if (mr->channel.valuesz != 0)
+	{
+		if (mr->channel.keysz == MR_STR_KEY)
+		{
+			if ((strkey = malloc(kv->keysz)) == NULL)
+				return -1;
+
+			memcpy(strkey, kv->key, kv->keysz);
+		}
+	}
+
+	/* wait for an empty locker to become available */
+	if (mr->lockers_in_use == locker_count(mr))
+	{
+		printf("%d waiting for empty locker\n", id);
+		pthread_cond_wait(&(mr->empty_locker_available_cv), &(mr->empty_locker_available_mutex));
+	}
+
+	printf("%d locker available for storage\n", id);
+
+	/* a locker is available! */
+	pthread_mutex_lock(&(mr->locks_mutex));
+
+	/* search for the empty locker */
+	for (int i = 0; i < locker_count(mr); i++)
+	{
+		if (mr->locks[i] != LOCKED)
+		{
+			printf("%d found empty locker %d, now producing\n", id, i);
+			/* we found an unlocked locker! */
+			mr->claims[id] = i;
+			mr->locks [i]  = LOCKED;
+			(mr->lockers_in_use)++;
+
+			pthread_mutex_unlock(&(mr->locks_mutex));
+			break;
+		}
+	}
+
+	/* what locker do I have? */
+	int my_locker 	   = mr->claims[id];
+
+	/* typed pairs go straight into the locker's fixed-size slot */
+	if (mr->channel.valuesz != 0)
+	{
+		char *slot = mr->slab + my_locker * mr->slot_size;
+
+		copy_field(slot, kv->value, mr->channel.valuesz);
+
+		if (strkey == NULL)
+		{
+			copy_field(slot + mr->channel.valuesz, kv->key, mr->channel.keysz);
+			strkey = slot + mr->channel.valuesz;
+		}
+
+		mr->lockers[my_locker].key     = strkey;
+		mr->lockers[my_locker].value   = slot;
+		mr->lockers[my_locker].keysz   = kv->keysz;
+		mr->lockers[my_locker].valuesz = kv->valuesz;
+
+		/* signal that some data is available to consume */
+		pthread_cond_signal(&(mr->locker_contents_available_cv));
+
+		return 1;
+	}
+
+	/* serialize the kvpair...using another kvpair! */
+	struct kvpair *locker_contents = malloc(sizeof(struct kvpair));
+
+	/* allocate the key and the value using the keysz and valuesz in kv */
+	locker_contents->key   = malloc(kv->keysz);
+	locker_contents->value = malloc(kv->valuesz);
+ 
+ 	/* copy the key and the value to the new kvpair */
+	memcpy(locker_contents->key,   kv->key,   kv->keysz);
+	memcpy(locker_contents->value, kv->value, kv->valuesz);
+
+	/* update keysz and valuesz in the new kvpair */
+	locker_contents->keysz   = kv->keysz;
+	locker_contents->valuesz = kv->valuesz;
+
+	/* store the new locker contents in my locker */
+	mr->lockers[my_locker] = *locker_contents;
+
+	/* signal that some data is available to consume */
+	printf("%d  signal that contents ready for consumption\n", id);
+	pthread_cond_signal(&(mr->locker_contents_available_cv));
+
+	// done
+	return 1;
+}
+
+/*
+ * Waits for map thread id's locker to have data.  Returns the locker, or -1
+ * if there is nothing left to consume.
+ */
+int consume_begin(struct map_reduce *mr, int id)
+{
+	/* wait until the locker has data */
+
+	if(mr->nmaps_done == mr->map_count)
+	{
+		printf("Leaving mr_consume as map threads are done\n");
+		return -1;	
+	}
+
+	if(mr->claims[id] == UNCLAIMED)
+	{
+		printf("Leaving mr_consume as nothing to be retrieved.\n");
+		return -1;
+	}
+
+	/* wait until at least one locker has data */
+	printf("%d waiting for locker data\n", id);
+
+	if (mr->lockers_in_use == 0 && mr->nmaps_done < mr->map_count)
+	{
+		pthread_cond_wait(&(mr->locker_contents_available_cv), &(mr->locker_contents_available_mutex));
+
+		pthread_cond_wait(&(mr->map_complete_cv), &(mr->map_complete_mutex));
+	}
+	
+	/* what locker do I have? */
+	int my_locker = mr->claims[id];
+
+	printf("%d consuming contents of locker %d\n", id, my_locker);
+
+	return my_locker;
+}
+
+/*
+ * Hands a consumed locker back to the producers.
+ */
+void consume_end(struct map_reduce *mr, int id, int my_locker)
+{
+	/* a typed pair's string key is the only part of it outside the slab */
+	if (mr->channel.valuesz != 0 && mr->channel.keysz == MR_STR_KEY)
+	{
+		free(mr->lockers[my_locker].key);
+		mr->lockers[my_locker].key = NULL;
+	}
+
+	/* mark the locker as unlocked and unclaimed*/
+	pthread_mutex_lock(&(mr->locks_mutex));
+	mr->locks[my_locker] = !(LOCKED);
+	(mr->lockers_in_use)--;
+	mr->claims[id] = UNCLAIMED;
+	pthread_mutex_unlock(&(mr->locks_mutex));
+
+	/* signal that a locker is now empty */
+	printf("%d locker %d is now consumed\n", id, my_locker);
+	pthread_cond_broadcast(&(mr->empty_locker_available_cv));
+}
+
+int mr_consume(struct map_reduce *mr, int id, struct kvpair *kv)
+{
+	int my_locker = consume_begin(mr, id);
+
+	if (my_locker < 0)
+		return 0;
+
+	/* unserialize (or not really) the data */
+	kv = &(mr->lockers[my_locker]);
+
+	consume_end(mr, id, my_locker);
+
+	return 1;
+}
+
+int mr_set_channel(struct map_reduce *mr, const struct mr_channel *channel)
+{
+	if (mr == NULL || channel == NULL || channel->valuesz == 0)
+		return -1;
+
+	/* values first, then fixed-size keys; string keys live outside the slab */
+	uint32_t keysz     = (channel->keysz == MR_STR_KEY) ? 0 : channel->keysz;
+	size_t   slot_size = (channel->valuesz + keysz + 7) / 8 * 8;
+	char    *slab      = malloc(locker_count(mr) * slot_size);
+
+	if (slab == NULL)
+		return -1;
+
+	free(mr->slab);
+
+	mr->channel   = *channel;
+	mr->slab      = slab;
+	mr->slot_size = slot_size;
+
+	return 0;
+}
+
+/* size of a key on the typed channel, including the NUL for string keys */
+static inline uint32_t channel_keysz(struct map_reduce *mr, const void *key)
+{
+	return (mr->channel.keysz == MR_STR_KEY) ? strlen(key) + 1 : mr->channel.keysz;
+}
+
+/*
+ * Sends one typed pair down the normal produce path, which caches, spools or
+ * stores it in a locker as needed.
+ */
+static int typed_emit(struct map_reduce *mr, int id, const void *key, const void *value)
+{
+	size_t keysz = channel_keysz(mr, key);
+
+	if (keysz > UINT32_MAX)
+		return -1;
+
+	struct kvpair kv = { (void *) key, (void *) value, keysz, mr->channel.valuesz };
+
+	return mr_produce(mr, id, &kv);
+}
+
+/* releases everything a combiner holds, without producing it */
+static void combiner_free(struct combiner *combiner)
+{
+	if (combiner->strkeys != NULL)
+	{
+		for (int i = 0; i < COMBINE_ENTRIES; i++)
+		{
+			free(combiner->strkeys[i]);
+		}
+	}
+
+	free(combiner->used);
+	free(combiner->keys);
+	free(combiner->strkeys);
+	free(combiner->values);
+}
+
+/* where entry i of a combiner keeps its key and value */
+static inline const void *combiner_key(struct combiner *combiner, int i)
+{
+	if (combiner->strkeys != NULL)
+		return combiner->strkeys[i];
+
+	return combiner->keys + (size_t) i * combiner->mr->channel.keysz;
+}
+
+static inline char *combiner_value(struct combiner *combiner, int i)
+{
+	return combiner->values + (size_t) i * combiner->mr->channel.valuesz;
+}
+
+/* does entry i of a combiner hold this key? */
+static inline bool combiner_holds(struct combiner *combiner, int i, const void *key)
+{
+	if (combiner->strkeys != NULL)
+		return strcmp(combiner->strkeys[i], key) == 0;
+
+	return memcmp(combiner_key(combiner, i), key, combiner->mr->channel.keysz) == 0;
+}
+
+/*
+ * Produces and empties entry i of a combiner.  Returns 1 on success, -1 on
+ * failure.
+ */
+static int combiner_evict(struct combiner *combiner, int i)
+{
+	int retval = typed_emit(combiner->mr, combiner->id,
+	                        combiner_key(combiner, i), combiner_value(combiner, i));
+
+	if (combiner->strkeys != NULL)
+	{
+		free(combiner->strkeys[i]);
+		combiner->strkeys[i] = NULL;
+	}
+
+	combiner->used[i] = false;
+
+	return retval;
+}
+
+/* produces every entry still held by a combiner; returns 0 or -1 */
+static int combiner_flush(struct combiner *combiner)
+{
+	int retval = 0;
+
+	for (int i = 0; combiner->used != NULL && i < COMBINE_ENTRIES; i++)
+	{
+		if (combiner->used[i] && combiner_evict(combiner, i) != 1)
+			retval = -1;
+	}
+
+	return retval;
+}
+
+/* allocates a combiner's table on first use; returns 0 or -1 */
+static int combiner_init(struct combiner *combiner)
+{
+	struct mr_channel *channel = &(combiner->mr->channel);
+
+	combiner->used   = calloc(COMBINE_ENTRIES, sizeof(bool));
+	combiner->values = malloc((size_t) COMBINE_ENTRIES * channel->valuesz);
+
+	if (channel->keysz == MR_STR_KEY)
+		combiner->strkeys = calloc(COMBINE_ENTRIES, sizeof(char *));
+	else
+		combiner->keys    = malloc((size_t) COMBINE_ENTRIES * channel->keysz);
+
+	if (combiner->used == NULL || combiner->values == NULL
+	    || (combiner->keys == NULL && combiner->strkeys == NULL))
+	{
+		combiner_free(combiner);
+		memset(combiner, 0, sizeof(*combiner));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Calls the map function with a combiner in place for typed produces, then
+ * produces whatever the combiner still holds.  Returns the map function's
+ * return value, or 1 if the combined pairs could not be produced.
+ */
+static int call_map(struct map_reduce *mr, int infd, int id, int nmaps)
+{
+	struct combiner combiner;
+
+	memset(&combiner, 0, sizeof(combiner));
+	combiner.mr = mr;
+	combiner.id = id;
+
+	current_combiner = &combiner;
+	int retval = (mr->map)(mr, infd, id, nmaps);
+	current_combiner = NULL;
+
+	if (combiner_flush(&combiner) < 0 && retval == 0)
+		retval = 1;
+
+	combiner_free(&combiner);
+
+	return retval;
+}
+
+int mr_produce_typed(struct map_reduce *mr, int id, const void *key, const void *value)
+{
+	if (mr == NULL || mr->channel.valuesz == 0)
+		return -1;
+
+	struct combiner   *combiner = current_combiner;
+	struct mr_channel *channel  = &(mr->channel);
+
+	/* nothing to combine with: straight to the lockers */
+	if (combiner == NULL || channel->combine == NULL || id != combiner->id)
+		return typed_emit(mr, id, key, value);
+
+	if (combiner->used == NULL && combiner_init(combiner) < 0)
+		return typed_emit(mr, id, key, value);
+
+	uint32_t keysz = channel_keysz(mr, key);
+	int      i     = fnv1a(FNV_OFFSET, key, keysz) % COMBINE_ENTRIES;
+
+	/* same key as last time this entry was used: fold the value in */
+	if (combiner->used[i] && combiner_holds(combiner, i, key))
+	{
+		channel->combine(combiner_value(combiner, i), value);
+		return 1;
+	}
+
+	/* someone else is in this entry: send them on their way */
+	if (combiner->used[i] && combiner_evict(combiner, i) != 1)
+		return -1;
+
+	if (combiner->strkeys != NULL)
+	{
+		if ((combiner->strkeys[i] = strdup(key)) == NULL)
+			return typed_emit(mr, id, key, value);
+	}
+	else
+	{
+		copy_field(combiner->keys + (size_t) i * keysz, key, keysz);
+	}
+
+	copy_field(combiner_value(combiner, i), value, channel->valuesz);
+	combiner->used[i] = true;
+
+	return 1;
+}
+
+int mr_consume_typed(struct map_reduce *mr, int id, void *key, uint32_t *keysz, void *value)
+{
+	if (mr == NULL || mr->channel.valuesz == 0)
+		return -1;
+
+	/* string keys vary in size, so the caller has to say how much room there is */
+	if (mr->channel.keysz == MR_STR_KEY && keysz == NULL)
+		return -1;
+
+	int my_locker = consume_begin(mr, id);
+
+	if (my_locker < 0)
+		return 0;
+
+	struct kvpair *contents = &(mr->lockers[my_locker]);
+
+	if (mr->channel.keysz == MR_STR_KEY)
+	{
+		uint32_t room = *keysz;
+
+		*keysz = contents->keysz;
+
+		/* leave the pair where it is, so the caller can retry with more room */
+		if (contents->keysz > room)
+			return -1;
+
+		memcpy(key, contents->key, contents->keysz);
+	}
+	else
+	{
+		copy_field(key, contents->key, mr->channel.keysz);
+
+		if (keysz != NULL)
+			*keysz = mr->channel.keysz;
+	}
+
+	copy_field(value, contents->value, mr->channel.valuesz);
+
+	consume_end(mr, id, my_locker);
+
+	return 1;
+}
+
+
+int mr_set_direct_io(struct map_reduce *mr, bool enabled)
+{
+	if (mr == NULL)
+		return -1;
+
+	mr->direct_io = enabled;
+
+	return 0;
+}
+
+/*
+ * Opens the input for one map attempt, with O_DIRECT if it was asked for and
+ * the filesystem allows it.
+ */
+int open_input(struct map_reduce *mr, const char *path)
+{
+	if (mr->direct_io)
+	{
+		int infd = open(path, O_RDONLY | O_DIRECT);
+
+		/* EINVAL means no direct I/O here; readers fall back to fadvise */
+		if (infd >= 0 || errno != EINVAL)
+			return infd;
+	}
+
+	return open(path, O_RDONLY);
+}
+
+/*
+ * Reads one block for the prefetcher.  Some filesystems accept O_DIRECT at
+ * open time but refuse the reads, in which case the descriptor is switched
+ * back to buffered I/O and the read retried.
+ */
+static ssize_t reader_pread(struct mr_reader *reader, void *buf, size_t count, int64_t offset)
+{
+	for (;;)
+	{
+		ssize_t got = pread(reader->fd, buf, count, offset);
+
+		if (got >= 0)
+			return got;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EINVAL && reader->direct)
+		{
+			int flags = fcntl(reader->fd, F_GETFL);
+
+			if (flags < 0 || fcntl(reader->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+				return -1;
+
+			reader->direct = false;
+			reader->drop   = true;
+			posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			continue;
+		}
+
+		return -1;
+	}
+}
+
+/*
+ * Prefetch thread: keeps filling whichever block the reader is not using,
+ * until end of file or until the reader is closed.
+ */
+void *reader_prefetch(void *arg)
+{
+	struct mr_reader *reader = arg;
+
+	pthread_mutex_lock(&(reader->mutex));
+
+	while (!reader->closing)
+	{
+		int slot = reader->fill;
+
+		/* wait for a free block and for something left to read */
+		if (reader->ready[slot] || reader->eof)
+		{
+			pthread_cond_wait(&(reader->cv), &(reader->mutex));
+			continue;
+		}
+
+		int64_t  offset     = reader->next_offset;
+		unsigned generation = reader->generation;
+
+		pthread_mutex_unlock(&(reader->mutex));
+
+		/* the last block read into this slot has been parsed, drop it */
+		if (reader->drop && reader->lengths[slot] > 0)
+		{
+			posix_fadvise(reader->fd, reader->offsets[slot], reader->lengths[slot],
+			              POSIX_FADV_DONTNEED);
+		}
+
+		ssize_t got = reader_pread(reader, reader->buffers[slot], reader->block_size, offset);
+
+		pthread_mutex_lock(&(reader->mutex));
+
+		/* the reader seeked while we were reading, so this block is stale */
+		if (generation != reader->generation)
+			continue;
+
+		reader->offsets[slot] = offset;
+		reader->lengths[slot] = got;
+		reader->ready[slot]   = true;
+		reader->fill          = !slot;
+
+		/* a short read means end of file (or an error): stop until a seek */
+		if (got < (ssize_t) reader->block_size)
+			reader->eof = true;
+		else
+			reader->next_offset += got;
+
+		pthread_cond_broadcast(&(reader->cv));
+	}
+
+	pthread_mutex_unlock(&(reader->mutex));
+
+	return NULL;
+}
+
+/*
+ * Resets the reader to offset, aligning the first read down to the block
+ * alignment.  Called with the reader's mutex held.
+ */
+static void reader_reset(struct mr_reader *reader, int64_t offset)
+{
+	int64_t aligned = offset - offset % READER_ALIGN;
+
+	(reader->generation)++;
+
+	reader->ready[0]    = false;
+	reader->ready[1]    = false;
+	reader->current     = 0;
+	reader->fill        = 0;
+	reader->cursor      = offset - aligned;
+	reader->pos         = offset;
+	reader->next_offset = aligned;
+	reader->eof         = false;
+
+	pthread_cond_broadcast(&(reader->cv));
+}
+
+struct mr_reader *mr_reader_open(struct map_reduce *mr, int infd, int64_t offset, size_t block_size)
+{
+	if (infd < 0 || offset < 0)
+		return NULL;
+
+	struct mr_reader *reader = calloc(1, sizeof(struct mr_reader));
+
+	if (reader == NULL)
+		return NULL;
+
+	if (block_size == 0)
+		block_size = READER_BLOCK;
+
+	/* O_DIRECT wants aligned buffers, offsets and sizes */
+	reader->fd         = infd;
+	reader->block_size = (block_size + READER_ALIGN - 1) / READER_ALIGN * READER_ALIGN;
+
+	int flags = fcntl(infd, F_GETFL);
+
+	if (flags < 0
+	    || posix_memalign((void **) &(reader->buffers[0]), READER_ALIGN, reader->block_size) != 0
+	    || posix_memalign((void **) &(reader->buffers[1]), READER_ALIGN, reader->block_size) != 0)
+	{
+		free(reader->buffers[0]);
+		free(reader);
+		return NULL;
+	}
+
+	/*
+	 * If direct I/O was asked for but the descriptor could not be opened that
+	 * way, fall back to telling the kernel we read straight through and do
+	 * not need the data again.  Otherwise leave the page cache alone: other
+	 * attempts and neighbouring splits may be about to read the same pages.
+	 */
+	reader->direct = (flags & O_DIRECT) != 0;
+	reader->drop   = !reader->direct && mr != NULL && mr->direct_io;
+
+	if (reader->drop)
+	{
+		posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	reader->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	reader->cv    = (pthread_cond_t)  PTHREAD_COND_INITIALIZER;
+
+	reader_reset(reader, offset);
+
+	if (pthread_create(&(reader->prefetcher), NULL, reader_prefetch, (void *) reader) != 0)
+	{
+		free(reader->buffers[0]);
+		free(reader->buffers[1]);
+		free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/*
+ * Waits for data and hands out up to max bytes of the current block, moving
+ * on to the other block once this one is used up.  Returns the number of bytes
+ * at *data, 0 at end of file, or -1 on error.
+ */
+static ssize_t reader_take(struct mr_reader *reader, size_t max, const void **data)
+{
+	ssize_t taken = 0;
+
+	pthread_mutex_lock(&(reader->mutex));
+
+	for (;;)
+	{
+		int slot = reader->current;
+
+		if (!reader->ready[slot])
+		{
+			pthread_cond_wait(&(reader->cv), &(reader->mutex));
+			continue;
+		}
+
+		ssize_t length = reader->lengths[slot];
+
+		if (length < 0)
+		{
+			taken = -1;
+			break;
+		}
+
+		if (reader->cursor < length)
+		{
+			size_t left = length - reader->cursor;
+
+			taken = (left < max) ? left : max;
+			*data = reader->buffers[slot] + reader->cursor;
+
+			reader->cursor += taken;
+			reader->pos    += taken;
+			break;
+		}
+
+		/* a short block is the last one */
+		if (length < (ssize_t) reader->block_size)
+			break;
+
+		/* done with this block, let the prefetcher refill it */
+		reader->ready[slot] = false;
+		reader->current     = !slot;
+		reader->cursor      = 0;
+
+		pthread_cond_broadcast(&(reader->cv));
+	}
+
+	pthread_mutex_unlock(&(reader->mutex));
+
+	return taken;
+}
+
+ssize_t mr_reader_read(struct mr_reader *reader, void *buf, size_t count)
+{
+	size_t copied = 0;
+
+	while (copied < count)
+	{
+		const void *data;
+		ssize_t     got = reader_take(reader, count - copied, &data);
+
+		if (got < 0)
+			return (copied > 0) ? (ssize_t) copied : -1;
+
+		if (got == 0)
+			break;
+
+		/* safe outside the lock: the block is not refilled until we ask for more */
+		memcpy((char *) buf + copied, data, got);
+		copied += got;
+	}
+
+	return copied;
+}
+
+ssize_t mr_reader_next(struct mr_reader *reader, const void **data)
+{
+	return reader_take(reader, SIZE_MAX, data);
+}
+
+int mr_reader_seek(struct mr_reader *reader, int64_t offset)
+{
+	if (reader == NULL || offset < 0)
+		return -1;
+
+	pthread_mutex_lock(&(reader->mutex));
+	reader_reset(reader, offset);
+	pthread_mutex_unlock(&(reader->mutex));
+
+	return 0;
+}
+
+int64_t mr_reader_tell(struct mr_reader *reader)
+{
+	pthread_mutex_lock(&(reader->mutex));
+	int64_t pos = reader->pos;
+	pthread_mutex_unlock(&(reader->mutex));
+
+	return pos;
+}
+
+void mr_reader_close(struct mr_reader *reader)
+{
+	if (reader == NULL)
+		return;
+
+	pthread_mutex_lock(&(reader->mutex));
+	reader->closing = true;
+	pthread_cond_broadcast(&(reader->cv));
+	pthread_mutex_unlock(&(reader->mutex));
+
+	pthread_join(reader->prefetcher, NULL);
+
+	/* drop whatever is still sitting in the page cache from our last blocks */
+	for (int slot = 0; slot < 2; slot++)
+	{
+		if (reader->drop && reader->lengths[slot] > 0)
+		{
+			posix_fadvise(reader->fd, reader->offsets[slot], reader->lengths[slot],
+			              POSIX_FADV_DONTNEED);
+		}
+	}
+
+	free(reader->buffers[0]);
+	free(reader->buffers[1]);
+	free(reader);
+}
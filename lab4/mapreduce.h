@@ -23,7 +23,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -57,6 +59,96 @@ typedef int (*map_fn)(struct map_reduce *mr, int infd, int id, int nmaps);
  */
 typedef int (*reduce_fn)(struct map_reduce *mr, int outfd, int nmaps);
 
+/**
+ * Per-split bookkeeping for speculative re-execution.  A split is one map id's
+ * share of the input; it may be worked on by more than one attempt.
+ */
+struct map_split {
+    /* when the first attempt at this split started */
+    struct timespec started;
+
+    /* seconds the winning attempt took, valid once won is set */
+    double          elapsed;
+
+    /* has an attempt finished (and had its output kept)? */
+    bool            won;
+
+    /* attempts at this split whose map function has not returned yet */
+    int             running;
+
+    /* input descriptors of those attempts, -1 for an unused entry */
+    int             fds[2];
+
+    /* has a backup attempt been launched? */
+    bool            backed_up;
+};
+
+/**
+ * Double-buffered sequential reader over an input file descriptor.  A
+ * prefetch thread fills one block-sized buffer while the Map function parses
+ * the other.  Reads are aligned so the descriptor may be opened with O_DIRECT.
+ * If direct I/O was asked for but is not supported, the reader hints the
+ * kernel with posix_fadvise instead and drops each block from the page cache
+ * once it has been parsed.
+ */
+struct mr_reader {
+    /* descriptor being read (not owned by the reader) and whether it is direct */
+    int             fd;
+    bool            direct;
+
+    /* direct I/O was asked for but fell back: drop parsed blocks from the cache */
+    bool            drop;
+
+    /* bytes per read, a multiple of the O_DIRECT alignment */
+    size_t          block_size;
+
+    /* the two blocks, their file offsets and valid lengths (-1 on error) */
+    char           *buffers[2];
+    int64_t         offsets[2];
+    ssize_t         lengths[2];
+
+    /* which blocks have been filled and not yet released by the reader */
+    bool            ready[2];
+
+    /* block being parsed, and how far into it the caller has got */
+    int             current;
+    size_t          cursor;
+
+    /* file offset of the next byte handed to the caller */
+    int64_t         pos;
+
+    /* prefetcher state: next block to fill and where it starts */
+    int             fill;
+    int64_t         next_offset;
+    bool            eof;
+
+    /* bumped on every seek so stale prefetches are thrown away */
+    unsigned        generation;
+    bool            closing;
+
+    pthread_t       prefetcher;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cv;
+};
+
+/* key size of a typed channel whose keys are NUL-terminated strings */
+#define MR_STR_KEY 0
+
+/**
+ * Shape of a typed channel (see mr_set_channel).  Usually generated by one of
+ * the MR_DEFINE_*_CHANNEL macros below rather than filled in by hand.
+ */
+struct mr_channel {
+    /* key size in bytes, or MR_STR_KEY for string keys */
+    uint32_t        keysz;
+
+    /* value size in bytes */
+    uint32_t        valuesz;
+
+    /* folds the value into acc for pairs with the same key, or NULL */
+    void          (*combine)(void *acc, const void *value);
+};
+
 /* End struct section */
 
 /*
@@ -133,6 +225,45 @@ struct map_reduce
 
     /* status code for mapreduce operation */
     int             status_code;
+
+    /* map-output cache directory and map identity tag (NULL if disabled) */
+    char           *cache_dir;
+    char           *cache_tag;
+
+    /* speculative re-execution of slow splits (see mr_set_speculation) */
+    bool            speculate;
+    double          spec_done_fraction;
+    double          spec_slowdown;
+
+    /* input path, so backup attempts can open their own descriptors */
+    char           *inpath;
+
+    /* one entry per map id, and how many of them have been won */
+    struct map_split *splits;
+    int             splits_won;
+
+    /* attempts (original or backup) whose map function is still running */
+    int             attempts_live;
+
+    /* protects splits, splits_won and attempts_live */
+    pthread_mutex_t spec_mutex;
+
+    /* signalled whenever an attempt finishes */
+    pthread_cond_t  spec_cv;
+
+    /* thread that watches for stragglers and launches backups */
+    pthread_t       spec_monitor;
+    bool            spec_monitor_started;
+
+    /* open map input descriptors with O_DIRECT (see mr_set_direct_io) */
+    bool            direct_io;
+
+    /* typed channel (see mr_set_channel); valuesz is 0 if pairs are untyped */
+    struct mr_channel channel;
+
+    /* one fixed-size slot per locker holding a typed pair's value and key */
+    char           *slab;
+    size_t          slot_size;
 };
 
 /**
@@ -239,4 +370,272 @@ int mr_produce(struct map_reduce *mr, int id, const struct kvpair *kv);
  */
 int mr_consume(struct map_reduce *mr, int id, struct kvpair *kv);
 
+/*
+ * Optional extensions
+ *
+ * These are not part of the six-function API above.  A caller that never uses
+ * them gets exactly the behavior described there.
+ */
+
+/**
+ * Enables the on-disk map-output cache.  The input is cut into chunks of about
+ * 1MB whose boundaries fall just after a newline, and each Map thread takes an
+ * equal share of the chunks.  Each chunk is hashed with SHA-256 together with
+ * map_tag; if a cache file for that hash already exists, and the chunk length
+ * and second hash stored in it match too, its key-value pairs are replayed
+ * through mr_produce instead of calling Map.  Otherwise Map is called on the
+ * chunk alone and the pairs it produces are recorded for the next run.  Must
+ * be called before mr_start.
+ *
+ * Chunk boundaries do not depend on the size of the file or the number of Map
+ * threads, so when a file only grows at the end, a rerun maps just the new
+ * data and the chunk that used to be last.
+ *
+ * With the cache on, Map is given a descriptor holding a single chunk, with
+ * id 0 and nmaps 1, and must map all of it; the pairs it produces are sent on
+ * to the real Map thread.  This only gives the same result as mapping the
+ * whole file if records (words, lines) never span a newline.
+ *
+ * mr         Pointer to the MapReduce instance
+ * cache_dir  Directory holding the cache files, created if it does not exist
+ * map_tag    Identifies the Map function and any arguments it depends on (for
+ *            example "grep:periwinkle").  Runs with different tags never
+ *            share cache entries.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int mr_set_cache(struct map_reduce *mr, const char *cache_dir, const char *map_tag);
+
+/**
+ * Enables speculative re-execution of straggling splits.  Once at least
+ * done_fraction of the splits have finished, any split whose first attempt
+ * has been running longer than slowdown times the median finished split is
+ * started again on a new thread with its own input file descriptor.
+ *
+ * While speculation is on, mr_produce spools each attempt's pairs to a private
+ * temporary file.  The first attempt at a split to return 0 from Map wins and
+ * its spool is streamed to the Reduce thread; the other attempt's spool is
+ * dropped, and its further calls to mr_produce fail so it can stop early.  A
+ * failed attempt only fails the split if no other attempt is still running.
+ *
+ * When a split is won, the input descriptor of the other attempt is replaced
+ * by one open on /dev/null, so its next read sees end of file.  A read already
+ * in progress still completes, and input the Map function has already mapped
+ * into memory is not affected.  mr_destroy waits for losing attempts to
+ * return, which is then at most the time of one read.  Must be called before
+ * mr_start.
+ *
+ * mr             Pointer to the MapReduce instance
+ * done_fraction  Fraction of splits, in (0, 1], that must be done before any
+ *                backup is launched
+ * slowdown       How many times the median split time a split must have run
+ *                before it gets a backup (greater than 1)
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int mr_set_speculation(struct map_reduce *mr, double done_fraction, double slowdown);
+
+/**
+ * Makes mr_start open the Map threads' input descriptors with O_DIRECT, so
+ * large inputs do not push other data out of the page cache.  If the
+ * filesystem does not support O_DIRECT the descriptors are opened normally.
+ * Map functions must then read through an mr_reader, since plain read() on an
+ * O_DIRECT descriptor fails unless the buffer, offset and size are aligned.
+ * Must be called before mr_start.
+ *
+ * mr       Pointer to the MapReduce instance
+ * enabled  Whether to use direct I/O
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int mr_set_direct_io(struct map_reduce *mr, bool enabled);
+
+/**
+ * Starts reading infd sequentially from the given offset.  The descriptor's
+ * own file offset is neither used nor changed, and it is not closed by
+ * mr_reader_close.
+ *
+ * mr          Pointer to the MapReduce instance, or NULL.  If mr_set_direct_io
+ *             was used on it but infd is not O_DIRECT, the reader falls back
+ *             to posix_fadvise hints; otherwise the page cache is left alone.
+ * infd        Input file descriptor, usually the one passed to Map
+ * offset      Byte offset to start reading from; need not be aligned
+ * block_size  Bytes per read, rounded up to the O_DIRECT alignment, or 0 for
+ *             the default
+ *
+ * Returns a new reader, or NULL on failure.
+ */
+struct mr_reader *mr_reader_open(struct map_reduce *mr, int infd, int64_t offset, size_t block_size);
+
+/**
+ * Copies up to count bytes into buf and advances the reader past them.
+ *
+ * Returns the number of bytes copied, 0 at end of file, or -1 on error.
+ */
+ssize_t mr_reader_read(struct mr_reader *reader, void *buf, size_t count);
+
+/**
+ * Hands out the rest of the current block without copying it, and advances the
+ * reader past it.  *data stays valid until the next call on this reader.
+ *
+ * Returns the number of bytes available at *data, 0 at end of file, or -1 on
+ * error.
+ */
+ssize_t mr_reader_next(struct mr_reader *reader, const void **data);
+
+/**
+ * Moves the reader to a new offset, discarding anything already prefetched.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int mr_reader_seek(struct mr_reader *reader, int64_t offset);
+
+/**
+ * Returns the offset of the next byte the reader will hand out.
+ */
+int64_t mr_reader_tell(struct mr_reader *reader);
+
+/**
+ * Stops the prefetch thread and frees the reader.  The file descriptor is left
+ * open.
+ */
+void mr_reader_close(struct mr_reader *reader);
+
+/**
+ * Makes every pair in this MapReduce operation have the given shape.  Each
+ * locker gets a fixed-size slot for the value and, unless keys are strings,
+ * the key, so typed pairs are stored without a per-pair allocation.  Pairs
+ * produced with mr_produce must then match the shape or they are refused.
+ * Must be called before mr_start.
+ *
+ * If the channel has a combine function, each Map thread also folds together
+ * pairs with the same key before they reach a locker, so Reduce may see one
+ * pair per key with the values already combined instead of one per
+ * occurrence.  Only use this where Reduce combines values the same way.
+ *
+ * The channel's shape, and whether it combines, is part of the map-output
+ * cache key, so typed and untyped runs with the same map_tag never replay
+ * each other's pairs.
+ *
+ * mr       Pointer to the MapReduce instance
+ * channel  Shape of the pairs, copied by this call
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int mr_set_channel(struct map_reduce *mr, const struct mr_channel *channel);
+
+/**
+ * Produces one pair on the typed channel.  key points to a key of the
+ * channel's key size, or to a NUL-terminated string; value points to a value
+ * of the channel's value size.  Otherwise like mr_produce.
+ */
+int mr_produce_typed(struct map_reduce *mr, int id, const void *key, const void *value);
+
+/**
+ * Consumes one pair from the typed channel into key and value.  For string
+ * keys, *keysz is the size of the key buffer on entry and is set to the size
+ * of the key, including its NUL, on return.  If the key does not fit, -1 is
+ * returned and the pair is left in place, so the call can be repeated with a
+ * buffer of *keysz bytes.  keysz may be NULL for fixed-size keys.  Otherwise
+ * like mr_consume.
+ */
+int mr_consume_typed(struct map_reduce *mr, int id, void *key, uint32_t *keysz, void *value);
+
+/*
+ * Typed channel definitions
+ *
+ * These macros generate a channel and static inline helpers for it.  For a
+ * channel called name they define:
+ *
+ *   name_channel()                             the struct mr_channel to pass
+ *                                              to mr_set_channel
+ *   int        name_produce(mr, id, key, value)
+ *   int        name_consume(mr, id, key, value) (string channels also take
+ *                                              &keysz, as mr_consume_typed)
+ *   value_type name_combine(a, b)              folds two values for one key
+ *
+ * combine is a function or function-like macro of two values, for example
+ * MR_COMBINE_SUM.
+ *
+ * The helpers give type checking at the call site, not code specialized for
+ * the channel.  mapreduce.c is compiled once for every shape, so it works from
+ * the struct mr_channel at run time: fields are copied by the sizes stored
+ * there, and the map-side combiner calls name_fold through a function
+ * pointer.  Spool and cache files keep the size header on each pair, and a
+ * string key still takes one allocation per pair in the lockers.  What a
+ * channel saves is the kvpair allocation for each pair with a fixed-size key,
+ * and the pairs the combiner folds together before they reach a locker.
+ */
+
+#define MR_COMBINE_SUM(a, b) ((a) + (b))
+#define MR_COMBINE_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* Combine helpers shared by both kinds of channel. */
+#define MR_DEFINE_CHANNEL_COMBINE(name, value_type, combine)                   \
+static inline value_type name##_combine(value_type a, value_type b)            \
+{                                                                              \
+    return combine(a, b);                                                      \
+}                                                                              \
+                                                                               \
+static inline void name##_fold(void *acc, const void *value)                   \
+{                                                                              \
+    value_type a, b;                                                           \
+    memcpy(&a, acc, sizeof(value_type));                                       \
+    memcpy(&b, value, sizeof(value_type));                                     \
+    a = name##_combine(a, b);                                                  \
+    memcpy(acc, &a, sizeof(value_type));                                       \
+}
+
+/* Channel with a fixed-size key of type key_type. */
+#define MR_DEFINE_FIXED_CHANNEL(name, key_type, value_type, combine)           \
+MR_DEFINE_CHANNEL_COMBINE(name, value_type, combine)                           \
+                                                                               \
+static inline const struct mr_channel *name##_channel(void)                    \
+{                                                                              \
+    static const struct mr_channel channel =                                   \
+        { sizeof(key_type), sizeof(value_type), name##_fold };                 \
+    return &channel;                                                           \
+}                                                                              \
+                                                                               \
+static inline int name##_produce(struct map_reduce *mr, int id,                \
+                                 key_type key, value_type value)               \
+{                                                                              \
+    return mr_produce_typed(mr, id, &key, &value);                             \
+}                                                                              \
+                                                                               \
+static inline int name##_consume(struct map_reduce *mr, int id,                \
+                                 key_type *key, value_type *value)             \
+{                                                                              \
+    return mr_consume_typed(mr, id, key, NULL, value);                         \
+}
+
+/* Channel with a NUL-terminated string key. */
+#define MR_DEFINE_STR_CHANNEL(name, value_type, combine)                       \
+MR_DEFINE_CHANNEL_COMBINE(name, value_type, combine)                           \
+                                                                               \
+static inline const struct mr_channel *name##_channel(void)                    \
+{                                                                              \
+    static const struct mr_channel channel =                                   \
+        { MR_STR_KEY, sizeof(value_type), name##_fold };                       \
+    return &channel;                                                           \
+}                                                                              \
+                                                                               \
+static inline int name##_produce(struct map_reduce *mr, int id,                \
+                                 const char *key, value_type value)            \
+{                                                                              \
+    return mr_produce_typed(mr, id, key, &value);                              \
+}                                                                              \
+                                                                               \
+static inline int name##_consume(struct map_reduce *mr, int id, char *key,     \
+                                 uint32_t *keysz, value_type *value)           \
+{                                                                              \
+    return mr_consume_typed(mr, id, key, keysz, value);                        \
+}
+
+/* word -> count, as produced by mr-wordc */
+MR_DEFINE_STR_CHANNEL(mr_str_u64, uint64_t, MR_COMBINE_SUM)
+
+/* integer key -> integer total */
+MR_DEFINE_FIXED_CHANNEL(mr_u64_u64, uint64_t, uint64_t, MR_COMBINE_SUM)
+
 #endif
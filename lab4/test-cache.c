@@ -0,0 +1,232 @@
+/******************************************************************************
+ * Tests for the map-output cache (mr_set_cache).
+ *
+ * The Reduce side of the framework cannot yet be driven end to end (see Known
+ * Bugs in README), so this includes mapreduce.c and runs each map thread
+ * directly with mr_run_map, then looks at the pairs left in the lockers.
+ *
+ * Build and run with "make check".
+ ******************************************************************************/
+
+#include "mapreduce.c"
+
+#include <dirent.h>
+
+#define TEST_LINES  200000	// lines in the test input, about 2.5MB
+
+static int failures = 0;
+
+#define CHECK(cond, ...)						\
+	do								\
+	{								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "  FAILED: " __VA_ARGS__);	\
+			fprintf(stderr, "\n");				\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* bytes handed to the map function over the whole run */
+static long mapped_bytes = 0;
+
+/*
+ * Counts the lines it is given and produces the count as a single pair.  The
+ * cache always calls it on a whole chunk, as map thread 0 of 1.
+ */
+static int count_lines(struct map_reduce *mr, int infd, int id, int nmaps)
+{
+	char    buf[65536];
+	ssize_t got;
+	long    lines = 0;
+
+	if (nmaps != 1)
+		return 1;
+
+	while ((got = read(infd, buf, sizeof(buf))) > 0)
+	{
+		__atomic_add_fetch(&mapped_bytes, got, __ATOMIC_SEQ_CST);
+
+		for (ssize_t i = 0; i < got; i++)
+		{
+			if (buf[i] == '\n')
+				lines++;
+		}
+	}
+
+	struct kvpair kv = { "lines", &lines, 6, sizeof(lines) };
+
+	return (mr_produce(mr, id, &kv) == 1) ? 0 : 1;
+}
+
+static int no_reduce(struct map_reduce *mr, int outfd, int nmaps)
+{
+	return 0;
+}
+
+/*
+ * Runs every map thread over the input through the cache, and returns the
+ * number of lines counted, or -1 if a map thread failed.
+ */
+static long run(const char *input, const char *cache, int nmaps)
+{
+	struct map_reduce *mr = mr_create(count_lines, no_reduce, nmaps, 256 * sizeof(struct kvpair));
+	long               total = 0;
+
+	mapped_bytes = 0;
+
+	if (mr == NULL || mr_set_cache(mr, cache, "count-lines") < 0)
+		return -1;
+
+	for (int id = 0; id < nmaps; id++)
+	{
+		int infd = open(input, O_RDONLY);
+
+		if (infd < 0 || mr_run_map(mr, infd, id) != 0)
+			total = -1;
+
+		close(infd);
+	}
+
+	for (int i = 0; total >= 0 && i < mr->lockers_in_use; i++)
+	{
+		total += *(long *) mr->lockers[i].value;
+	}
+
+	mr_destroy(mr);
+
+	return total;
+}
+
+static void write_lines(const char *path, const char *mode, int first, int count)
+{
+	FILE *fp = fopen(path, mode);
+
+	for (int i = first; i < first + count; i++)
+	{
+		fprintf(fp, "line %d of the test input\n", i);
+	}
+
+	fclose(fp);
+}
+
+static long file_size(const char *path)
+{
+	struct stat st;
+
+	return (stat(path, &st) == 0) ? st.st_size : -1;
+}
+
+/* how many cache files there are, and the paths of the first and last */
+static int cache_files(const char *cache, char first[PATH_MAX], char last[PATH_MAX])
+{
+	DIR           *dir = opendir(cache);
+	struct dirent *entry;
+	int            count = 0;
+
+	while (dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+
+		if (count == 0)
+			snprintf(first, PATH_MAX, "%s/%s", cache, entry->d_name);
+
+		snprintf(last, PATH_MAX, "%s/%s", cache, entry->d_name);
+		count++;
+	}
+
+	if (dir != NULL)
+		closedir(dir);
+
+	return count;
+}
+
+static void remove_tree(const char *path)
+{
+	DIR           *dir = opendir(path);
+	struct dirent *entry;
+	char           child[PATH_MAX];
+
+	while (dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		remove_tree(child);
+	}
+
+	if (dir != NULL)
+		closedir(dir);
+
+	remove(path);
+}
+
+int main(void)
+{
+	char dir[] = "test-cache.XXXXXX";
+	char input[PATH_MAX], cache[PATH_MAX], file[PATH_MAX], other[PATH_MAX];
+
+	verbose = false;
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(input, sizeof(input), "%s/input", dir);
+	snprintf(cache, sizeof(cache), "%s/cache", dir);
+
+	write_lines(input, "w", 0, TEST_LINES);
+
+	fprintf(stderr, "first run maps everything\n");
+	CHECK(run(input, cache, 2) == TEST_LINES, "wrong line count");
+	CHECK(mapped_bytes == file_size(input), "mapped %ld of %ld bytes", mapped_bytes, file_size(input));
+
+	fprintf(stderr, "rerun with a different map count replays everything\n");
+	CHECK(run(input, cache, 3) == TEST_LINES, "wrong line count");
+	CHECK(mapped_bytes == 0, "mapped %ld bytes", mapped_bytes);
+
+	fprintf(stderr, "appending only maps the old last chunk and the new data\n");
+	write_lines(input, "a", TEST_LINES, 1000);
+	CHECK(run(input, cache, 2) == TEST_LINES + 1000, "wrong line count");
+	CHECK(mapped_bytes > 0 && mapped_bytes < 2 * CACHE_CHUNK, "mapped %ld bytes", mapped_bytes);
+
+	fprintf(stderr, "a corrupt cache file is removed and its chunk remapped\n");
+	int before = cache_files(cache, file, other);
+	FILE *fp = fopen(file, "r+b");
+	fseek(fp, 20, SEEK_SET);
+	fputc(fgetc(fp) ^ 0xff, fp);
+	fclose(fp);
+	CHECK(run(input, cache, 2) == TEST_LINES + 1000, "wrong line count");
+	CHECK(mapped_bytes > 0 && mapped_bytes < 2 * CACHE_CHUNK, "mapped %ld bytes", mapped_bytes);
+	CHECK(cache_files(cache, file, other) == before, "cache file was not rewritten");
+
+	/* as if two chunks collided on the file name */
+	fprintf(stderr, "a cache file recorded for another chunk is never replayed\n");
+	CHECK(before > 1 && remove(other) == 0 && link(file, other) == 0,
+	      "could not plant a mismatched cache file");
+	CHECK(run(input, cache, 2) == TEST_LINES + 1000, "mismatched cache file was replayed");
+	CHECK(mapped_bytes > 0, "nothing was remapped");
+
+	fprintf(stderr, "a record longer than a chunk stays whole\n");
+	remove_tree(cache);
+	fp = fopen(input, "w");
+	fprintf(fp, "short\n");
+	for (int i = 0; i < 3 * CACHE_CHUNK; i++)
+	{
+		fputc('x', fp);
+	}
+	fprintf(fp, "\nshort\n");
+	fclose(fp);
+	CHECK(run(input, cache, 1) == 3, "wrong line count with one map thread");
+	CHECK(run(input, cache, 4) == 3, "wrong line count with four map threads");
+
+	remove_tree(dir);
+
+	fprintf(stderr, "test-cache: %s\n", (failures == 0) ? "passed" : "FAILED");
+
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,277 @@
+/******************************************************************************
+ * Tests for typed key-value channels (mr_set_channel and the
+ * MR_DEFINE_*_CHANNEL helpers).
+ *
+ * The Reduce side of the framework cannot yet be driven end to end (see Known
+ * Bugs in README), so this includes mapreduce.c and runs a map thread
+ * directly with mr_run_map, then looks at the pairs left in the lockers.
+ *
+ * Build and run with "make check".
+ ******************************************************************************/
+
+#include "mapreduce.c"
+
+#include <dirent.h>
+
+#define WORDS       10	// distinct words in the input
+#define REPEATS     100	// times each word appears
+#define LOCKERS     (2 * WORDS * REPEATS)
+
+static int failures = 0;
+
+#define CHECK(cond, ...)						\
+	do								\
+	{								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "  FAILED: " __VA_ARGS__);	\
+			fprintf(stderr, "\n");				\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* how the map function produces its pairs */
+enum produce_as { UNTYPED, STR_U64, U64_U64 };
+
+static enum produce_as produce_as;
+
+/* words handed to the map function over the whole run */
+static long mapped_words = 0;
+
+/*
+ * Produces each word in the input ("word0" to "word9") with a count of 1:
+ * untyped with a text value, on the mr_str_u64 channel, or on the mr_u64_u64
+ * channel keyed by the word's number.
+ */
+static int count_words(struct map_reduce *mr, int infd, int id, int nmaps)
+{
+	FILE *fp = fdopen(dup(infd), "r");
+	char  word[32];
+	int   retval = 1;
+
+	while (retval == 1 && fscanf(fp, "%31s", word) == 1)
+	{
+		mapped_words++;
+
+		if (produce_as == STR_U64)
+		{
+			retval = mr_str_u64_produce(mr, id, word, 1);
+		}
+		else if (produce_as == U64_U64)
+		{
+			retval = mr_u64_u64_produce(mr, id, strtoull(word + 4, NULL, 10), 1);
+		}
+		else
+		{
+			struct kvpair kv = { word, "1", strlen(word) + 1, 2 };
+			retval = mr_produce(mr, id, &kv);
+		}
+	}
+
+	fclose(fp);
+
+	return (retval == 1) ? 0 : 1;
+}
+
+static int no_reduce(struct map_reduce *mr, int outfd, int nmaps)
+{
+	return 0;
+}
+
+/* a channel with the shape of mr_str_u64 that does not combine */
+static const struct mr_channel uncombined = { MR_STR_KEY, sizeof(uint64_t), NULL };
+
+/*
+ * Maps the input with one map thread, on the given channel (NULL for none)
+ * and through the cache if one is given.  Returns the instance with the pairs
+ * still in its lockers, or NULL if mapping failed.
+ */
+static struct map_reduce *run(const char *input, const char *cache,
+                              enum produce_as as, const struct mr_channel *channel)
+{
+	struct map_reduce *mr = mr_create(count_words, no_reduce, 1, LOCKERS * sizeof(struct kvpair));
+
+	produce_as   = as;
+	mapped_words = 0;
+
+	if (mr == NULL || (channel != NULL && mr_set_channel(mr, channel) < 0)
+	    || (cache != NULL && mr_set_cache(mr, cache, "count-words") < 0))
+	{
+		mr_destroy(mr);
+		return NULL;
+	}
+
+	int infd   = open(input, O_RDONLY);
+	int retval = mr_run_map(mr, infd, 0);
+
+	close(infd);
+
+	if (retval != 0)
+	{
+		mr_destroy(mr);
+		return NULL;
+	}
+
+	return mr;
+}
+
+/*
+ * Checks the pairs a typed run left in the lockers: every word's values must
+ * add up to REPEATS.  Returns the number of pairs.
+ */
+static int check_counts(const char *what, struct map_reduce *mr, bool string_keys)
+{
+	uint64_t counts[WORDS] = { 0 };
+
+	if (mr == NULL)
+	{
+		CHECK(false, "%s: mapping failed", what);
+		return 0;
+	}
+
+	for (int i = 0; i < mr->lockers_in_use; i++)
+	{
+		struct kvpair *kv = &(mr->lockers[i]);
+		uint64_t       key, value;
+
+		if (string_keys)
+			key = strtoull((char *) kv->key + 4, NULL, 10);
+		else
+			memcpy(&key, kv->key, sizeof(key));
+
+		memcpy(&value, kv->value, sizeof(value));
+
+		if (key < WORDS)
+			counts[key] += value;
+	}
+
+	for (int w = 0; w < WORDS; w++)
+	{
+		CHECK(counts[w] == REPEATS, "%s: word%d counted %llu times", what, w,
+		      (unsigned long long) counts[w]);
+	}
+
+	return mr->lockers_in_use;
+}
+
+static void remove_tree(const char *path)
+{
+	DIR           *dir = opendir(path);
+	struct dirent *entry;
+	char           child[PATH_MAX];
+
+	while (dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		remove_tree(child);
+	}
+
+	if (dir != NULL)
+		closedir(dir);
+
+	remove(path);
+}
+
+int main(void)
+{
+	char dir[] = "test-channel.XXXXXX";
+	char input[PATH_MAX], cache[PATH_MAX];
+
+	verbose = false;
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(input, sizeof(input), "%s/input", dir);
+	snprintf(cache, sizeof(cache), "%s/cache", dir);
+
+	FILE *fp = fopen(input, "w");
+	for (int i = 0; i < WORDS * REPEATS; i++)
+	{
+		fprintf(fp, "word%d\n", i % WORDS);
+	}
+	fclose(fp);
+
+	struct map_reduce *mr;
+	int                pairs;
+
+	fprintf(stderr, "without a combine function every pair reaches a locker\n");
+	mr    = run(input, NULL, STR_U64, &uncombined);
+	pairs = check_counts("uncombined", mr, true);
+	CHECK(pairs == WORDS * REPEATS, "uncombined: %d pairs", pairs);
+	mr_destroy(mr);
+
+	fprintf(stderr, "a combining string channel folds pairs with the same key\n");
+	mr    = run(input, NULL, STR_U64, mr_str_u64_channel());
+	pairs = check_counts("mr_str_u64", mr, true);
+	CHECK(pairs == WORDS, "mr_str_u64: %d pairs", pairs);
+
+	fprintf(stderr, "a key that does not fit stays in its locker until it does\n");
+	char     key[16];
+	uint32_t keysz = 3;
+	uint64_t value = 0;
+
+	CHECK(mr != NULL && mr_str_u64_consume(mr, 0, key, &keysz, &value) == -1,
+	      "short key buffer was accepted");
+	CHECK(keysz == strlen("word0") + 1, "needed key size reported as %u", keysz);
+	CHECK(mr != NULL && mr->lockers_in_use == WORDS, "the pair was dropped");
+
+	keysz = sizeof(key);
+	CHECK(mr != NULL && mr_str_u64_consume(mr, 0, key, &keysz, &value) == 1
+	      && strncmp(key, "word", 4) == 0 && value == REPEATS,
+	      "retry consumed %.*s = %llu", (int) keysz, key, (unsigned long long) value);
+
+	fprintf(stderr, "pairs of the wrong shape are refused\n");
+	struct kvpair wrong = { "word0", "1", 6, 2 };
+	CHECK(mr != NULL && mr_produce(mr, 0, &wrong) == -1, "a two-byte value was accepted");
+	mr_destroy(mr);
+
+	fprintf(stderr, "a fixed-key channel keeps its keys in the locker slab\n");
+	mr    = run(input, NULL, U64_U64, mr_u64_u64_channel());
+	pairs = check_counts("mr_u64_u64", mr, false);
+	CHECK(pairs == WORDS, "mr_u64_u64: %d pairs", pairs);
+
+	for (int i = 0; mr != NULL && i < mr->lockers_in_use; i++)
+	{
+		char *key = mr->lockers[i].key;
+
+		CHECK(key >= mr->slab && key < mr->slab + locker_count(mr) * mr->slot_size,
+		      "locker %d key is outside the slab", i);
+	}
+
+	mr_destroy(mr);
+
+	fprintf(stderr, "typed and untyped runs do not share cache entries\n");
+	mr = run(input, cache, UNTYPED, NULL);
+	CHECK(mr != NULL && mr->lockers_in_use == WORDS * REPEATS, "untyped run failed");
+	mr_destroy(mr);
+
+	mr    = run(input, cache, STR_U64, mr_str_u64_channel());
+	pairs = check_counts("typed after untyped", mr, true);
+	CHECK(mapped_words == WORDS * REPEATS, "typed run replayed the untyped entries");
+	CHECK(pairs == WORDS, "typed after untyped: %d pairs", pairs);
+	mr_destroy(mr);
+
+	mr    = run(input, cache, STR_U64, mr_str_u64_channel());
+	pairs = check_counts("typed rerun", mr, true);
+	CHECK(mapped_words == 0, "typed rerun mapped %ld words", mapped_words);
+	CHECK(pairs == WORDS, "typed rerun: %d pairs", pairs);
+	mr_destroy(mr);
+
+	mr = run(input, cache, UNTYPED, NULL);
+	CHECK(mr != NULL && mr->lockers_in_use == WORDS * REPEATS, "untyped rerun got combined pairs");
+	CHECK(mapped_words == 0, "untyped rerun mapped %ld words", mapped_words);
+	mr_destroy(mr);
+
+	remove_tree(dir);
+
+	fprintf(stderr, "test-channel: %s\n", (failures == 0) ? "passed" : "FAILED");
+
+	return (failures == 0) ? 0 : 1;
+}
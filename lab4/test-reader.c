@@ -0,0 +1,232 @@
+/******************************************************************************
+ * Tests for the double-buffered input reader (mr_reader_*) and direct I/O
+ * (mr_set_direct_io).
+ *
+ * Only the public reader API is used, but mapreduce.c is included as in the
+ * other extension tests so they all build the same way.
+ *
+ * Build and run with "make check".
+ ******************************************************************************/
+
+#include "mapreduce.c"
+
+#define TEST_SIZE   (10 * (1 << 20) + 123)	// not a multiple of any block size
+#define TEST_START  12345			// unaligned first offset
+#define FAR_OFFSET  (4LL * (1 << 30) + 512 * (1 << 20) + 7)	// past 4GB, unaligned
+
+static int failures = 0;
+
+#define CHECK(cond, ...)						\
+	do								\
+	{								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "  FAILED: " __VA_ARGS__);	\
+			fprintf(stderr, "\n");				\
+			failures++;					\
+		}							\
+	} while (0)
+
+static char expected[TEST_SIZE];
+static char got[TEST_SIZE];
+
+static int no_map(struct map_reduce *mr, int infd, int id, int nmaps)
+{
+	return 0;
+}
+
+static int no_reduce(struct map_reduce *mr, int outfd, int nmaps)
+{
+	return 0;
+}
+
+/*
+ * Reads the file from TEST_START to the end in reads of varying sizes, and
+ * checks what comes back.
+ */
+static void check_contents(const char *what, int infd, size_t block_size)
+{
+	struct mr_reader *reader = mr_reader_open(NULL, infd, TEST_START, block_size);
+	size_t            pos    = TEST_START;
+	size_t            step   = 1;
+	ssize_t           n;
+
+	CHECK(reader != NULL, "%s: could not open a reader", what);
+
+	if (reader == NULL)
+		return;
+
+	while ((n = mr_reader_read(reader, got + pos, step)) > 0)
+	{
+		pos  += n;
+		step  = step * 3 % 70001 + 1;
+	}
+
+	CHECK(n == 0 && pos == TEST_SIZE, "%s: read %zu bytes", what, pos - TEST_START);
+	CHECK(memcmp(got + TEST_START, expected + TEST_START, pos - TEST_START) == 0,
+	      "%s: wrong data", what);
+
+	/* zero-copy reads after a seek into the middle of a block */
+	const void *data;
+
+	CHECK(mr_reader_seek(reader, TEST_SIZE - 100000) == 0, "%s: seek failed", what);
+	CHECK(mr_reader_tell(reader) == TEST_SIZE - 100000, "%s: tell after seek", what);
+
+	n = mr_reader_next(reader, &data);
+
+	CHECK(n > 0 && n <= 100000 && memcmp(data, expected + TEST_SIZE - 100000, n) == 0,
+	      "%s: wrong data after seek", what);
+
+	/* past the end there is nothing to read */
+	CHECK(mr_reader_seek(reader, TEST_SIZE + 5000) == 0 && mr_reader_read(reader, got, 10) == 0,
+	      "%s: read past end of file", what);
+
+	mr_reader_close(reader);
+}
+
+/* how many of the file's pages are in the page cache */
+static long resident_pages(const char *path)
+{
+	int    fd    = open(path, O_RDONLY);
+	off_t  size  = lseek(fd, 0, SEEK_END);
+	size_t pages = (size + 4095) / 4096;
+	long   count = 0;
+
+	void          *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	unsigned char *in  = malloc(pages);
+
+	if (map != MAP_FAILED && in != NULL && mincore(map, size, in) == 0)
+	{
+		for (size_t i = 0; i < pages; i++)
+		{
+			count += in[i] & 1;
+		}
+	}
+
+	free(in);
+
+	if (map != MAP_FAILED)
+		munmap(map, size);
+
+	close(fd);
+
+	return count;
+}
+
+/* reads the whole file through a reader, as a Map thread of mr would */
+static void read_through(struct map_reduce *mr, const char *path)
+{
+	int               fd     = open(path, O_RDONLY);
+	struct mr_reader *reader = mr_reader_open(mr, fd, 0, 0);
+
+	while (mr_reader_read(reader, got, sizeof(got)) > 0)
+		;
+
+	mr_reader_close(reader);
+	close(fd);
+}
+
+int main(void)
+{
+	char dir[] = "test-reader.XXXXXX";
+	char input[PATH_MAX], sparse[PATH_MAX];
+
+	verbose = false;
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(input,  sizeof(input),  "%s/input",  dir);
+	snprintf(sparse, sizeof(sparse), "%s/sparse", dir);
+
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < TEST_SIZE; i++)
+	{
+		seed        = seed * 1103515245 + 12345;
+		expected[i] = seed >> 24;
+	}
+
+	int fd = open(input, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+	CHECK(write(fd, expected, TEST_SIZE) == TEST_SIZE, "could not write the input");
+	fsync(fd);
+	close(fd);
+
+	fprintf(stderr, "buffered reads return the file, in any read size\n");
+	fd = open(input, O_RDONLY);
+	check_contents("default blocks", fd, 0);
+	check_contents("5000-byte blocks", fd, 5000);
+	close(fd);
+
+	fd = open(input, O_RDONLY | O_DIRECT);
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "O_DIRECT is not supported here, skipping direct reads\n");
+	}
+	else
+	{
+		fprintf(stderr, "direct reads return the file, in any read size\n");
+		check_contents("direct, default blocks", fd, 0);
+		check_contents("direct, 8192-byte blocks", fd, 8192);
+		close(fd);
+	}
+
+	fprintf(stderr, "offsets past 4GB work\n");
+	fd = open(sparse, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+	CHECK(pwrite(fd, "marker", 6, FAR_OFFSET) == 6, "could not write past 4GB");
+
+	struct mr_reader *reader = mr_reader_open(NULL, fd, FAR_OFFSET - 3, 0);
+	char              marker[10] = "";
+
+	CHECK(reader != NULL && mr_reader_read(reader, marker, sizeof(marker)) == 9
+	      && memcmp(marker, "\0\0\0marker", 9) == 0, "wrong data past 4GB");
+	CHECK(reader != NULL && mr_reader_tell(reader) == FAR_OFFSET + 6, "wrong offset past 4GB");
+
+	mr_reader_close(reader);
+	close(fd);
+	remove(sparse);
+
+	/*
+	 * The reader only drops pages when direct I/O was asked for and could not
+	 * be had.  Pages another attempt is about to read must otherwise stay.
+	 */
+	struct map_reduce *mr   = mr_create(no_map, no_reduce, 1, 4096);
+	long               all  = (TEST_SIZE + 4095) / 4096;
+
+	fprintf(stderr, "without direct I/O the page cache is left alone\n");
+	read_through(mr, input);
+	CHECK(resident_pages(input) == all, "%ld of %ld pages left", resident_pages(input), all);
+
+	read_through(NULL, input);
+	CHECK(resident_pages(input) == all, "%ld of %ld pages left", resident_pages(input), all);
+
+	/* see whether this filesystem drops clean pages at all */
+	fd = open(input, O_RDONLY);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	if (resident_pages(input) != 0)
+	{
+		fprintf(stderr, "this filesystem keeps dropped pages, skipping the fallback check\n");
+	}
+	else
+	{
+		fprintf(stderr, "when direct I/O falls back, parsed blocks are dropped\n");
+		mr_set_direct_io(mr, true);
+		read_through(mr, input);
+		CHECK(resident_pages(input) < all / 4, "%ld of %ld pages left", resident_pages(input), all);
+	}
+
+	mr_destroy(mr);
+
+	remove(input);
+	remove(dir);
+
+	fprintf(stderr, "test-reader: %s\n", (failures == 0) ? "passed" : "FAILED");
+
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/******************************************************************************
+ * Tests for speculative re-execution of straggling splits (mr_set_speculation).
+ *
+ * The Reduce side of the framework cannot yet be driven end to end (see Known
+ * Bugs in README), so this includes mapreduce.c, starts the operation with
+ * mr_start, waits for every map thread to report in, and then looks at the
+ * pairs left in the lockers.
+ *
+ * Build and run with "make check".
+ ******************************************************************************/
+
+#include "mapreduce.c"
+
+#define SPLITS      4
+#define SPLIT_SIZE  (1 << 20)	// bytes of input each map id reads
+#define SLOW_SPLIT  1		// the split whose first attempt is slow
+
+static int failures = 0;
+
+#define CHECK(cond, ...)						\
+	do								\
+	{								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "  FAILED: " __VA_ARGS__);	\
+			fprintf(stderr, "\n");				\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* how the first attempt at SLOW_SPLIT behaves */
+enum straggler { SLOW_READS, FAILS_EARLY };
+
+static enum straggler straggler;
+
+/* attempts started per split, and the bytes each attempt read */
+static int  attempts[SPLITS];
+static long bytes_read[SPLITS][2];
+
+/*
+ * Produces one pair for a split: the key is the map id, and the value is the
+ * number of bytes read times 10 plus the attempt number, or -1 on failure.
+ */
+static int produce_split(struct map_reduce *mr, int id, long value)
+{
+	char          key[2] = { '0' + id, '\0' };
+	struct kvpair kv     = { key, &value, sizeof(key), sizeof(value) };
+
+	return mr_produce(mr, id, &kv);
+}
+
+/*
+ * Reads this map id's share of the input and produces how much it read.
+ */
+static int read_split(struct map_reduce *mr, int infd, int id, int nmaps)
+{
+	int     attempt = __atomic_fetch_add(&attempts[id], 1, __ATOMIC_SEQ_CST);
+	bool    slow    = (id == SLOW_SPLIT && attempt == 0);
+	char    buf[4096];
+	ssize_t got;
+	long    total = 0;
+
+	if (slow && straggler == FAILS_EARLY)
+	{
+		usleep(150000);
+		produce_split(mr, id, -1);
+
+		return 1;
+	}
+
+	/* the backup of a split that fails early is slow too, but succeeds */
+	if (id == SLOW_SPLIT && straggler == FAILS_EARLY)
+		usleep(300000);
+
+	lseek(infd, (off_t) id * SPLIT_SIZE, SEEK_SET);
+
+	while (total < SPLIT_SIZE && (got = read(infd, buf, sizeof(buf))) > 0)
+	{
+		total += got;
+
+		/* about half a second for the whole split */
+		if (slow)
+			usleep(2000);
+	}
+
+	bytes_read[id][attempt] = total;
+
+	/* a losing attempt's produce fails, which is fine: it has lost */
+	produce_split(mr, id, total * 10 + attempt);
+
+	return 0;
+}
+
+static int no_reduce(struct map_reduce *mr, int outfd, int nmaps)
+{
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs one speculative operation over the input.  Fills in the value each
+ * split produced (0 if none, -2 if more than one) and returns the seconds
+ * mr_destroy took, or -1 if the map threads did not all report in.
+ */
+static double run(const char *input, const char *output, long values[SPLITS])
+{
+	struct map_reduce *mr = mr_create(read_split, no_reduce, SPLITS, 64 * sizeof(struct kvpair));
+	double             start = now();
+
+	memset(attempts,   0, sizeof(attempts));
+	memset(bytes_read, 0, sizeof(bytes_read));
+
+	if (mr == NULL || mr_set_speculation(mr, 0.5, 2) < 0 || mr_start(mr, input, output) != 0)
+		return -1;
+
+	while (__atomic_load_n(&(mr->nmaps_done), __ATOMIC_SEQ_CST) < SPLITS && now() - start < 10)
+	{
+		usleep(1000);
+	}
+
+	if (mr->nmaps_done < SPLITS)
+		return -1;
+
+	for (int id = 0; id < SPLITS; id++)
+	{
+		values[id] = 0;
+	}
+
+	/* nothing has been consumed, so the pairs fill the first lockers */
+	for (int i = 0; i < mr->lockers_in_use; i++)
+	{
+		int  id    = ((char *) mr->lockers[i].key)[0] - '0';
+		long value = *(long *) mr->lockers[i].value;
+
+		values[id] = (values[id] == 0) ? value : -2;
+	}
+
+	CHECK(mr->status_code == 0, "operation reported failure");
+
+	double destroy = now();
+	mr_destroy(mr);
+
+	return now() - destroy;
+}
+
+int main(void)
+{
+	char dir[] = "test-speculation.XXXXXX";
+	char input[PATH_MAX], output[PATH_MAX];
+	long values[SPLITS];
+
+	verbose = false;
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(input,  sizeof(input),  "%s/input",  dir);
+	snprintf(output, sizeof(output), "%s/output", dir);
+
+	FILE *fp = fopen(input, "w");
+	for (long i = 0; i < (long) SPLITS * SPLIT_SIZE; i++)
+	{
+		fputc('a' + i % 26, fp);
+	}
+	fclose(fp);
+
+	fprintf(stderr, "a straggler is backed up, and the backup's output is kept\n");
+	straggler = SLOW_READS;
+	double destroy = run(input, output, values);
+	CHECK(destroy >= 0, "map threads did not finish");
+	CHECK(attempts[SLOW_SPLIT] == 2, "%d attempts at the slow split", attempts[SLOW_SPLIT]);
+
+	for (int id = 0; id < SPLITS; id++)
+	{
+		CHECK(values[id] / 10 == SPLIT_SIZE, "split %d produced %ld", id, values[id]);
+	}
+
+	CHECK(values[SLOW_SPLIT] % 10 == 1, "the slow attempt won its split");
+
+	fprintf(stderr, "the losing attempt stops reading once its split is won\n");
+	CHECK(bytes_read[SLOW_SPLIT][0] < SPLIT_SIZE / 2, "loser read %ld bytes", bytes_read[SLOW_SPLIT][0]);
+	CHECK(destroy < 0.1, "mr_destroy waited %.3fs for the loser", destroy);
+
+	fprintf(stderr, "an attempt that fails first does not win its split\n");
+	straggler = FAILS_EARLY;
+	destroy = run(input, output, values);
+	CHECK(destroy >= 0, "map threads did not finish");
+	CHECK(attempts[SLOW_SPLIT] == 2, "%d attempts at the failing split", attempts[SLOW_SPLIT]);
+	CHECK(values[SLOW_SPLIT] == (long) SPLIT_SIZE * 10 + 1,
+	      "failing split produced %ld", values[SLOW_SPLIT]);
+
+	remove(input);
+	remove(output);
+	remove(dir);
+
+	fprintf(stderr, "test-speculation: %s\n", (failures == 0) ? "passed" : "FAILED");
+
+	return (failures == 0) ? 0 : 1;
+}